@@ -0,0 +1,957 @@
+#ifndef PARKTREE_KTREE_H
+#define PARKTREE_KTREE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <random>
+#include <unordered_set>
+#include <unordered_map>
+#include <set>
+#include <exception>
+#include <stdexcept>
+#include <omp.h>
+
+namespace parktree {
+
+// Signatures are stored as a fixed number of 64-bit words, two bits per nucleotide.
+// Specialise this for any other signature type the tree should hold.
+template<class Signature>
+struct SignatureTraits;
+
+template<>
+struct SignatureTraits<uint64_t> {
+  static constexpr size_t words = 1;
+  static uint64_t *data(uint64_t &sig) { return &sig; }
+  static const uint64_t *data(const uint64_t &sig) { return &sig; }
+};
+
+template<size_t N>
+struct SignatureTraits<std::array<uint64_t, N>> {
+  static constexpr size_t words = N;
+  static uint64_t *data(std::array<uint64_t, N> &sig) { return sig.data(); }
+  static const uint64_t *data(const std::array<uint64_t, N> &sig) { return sig.data(); }
+};
+
+// Number of mismatching nucleotides between two signatures
+template<class Signature>
+size_t signatureDistance(const Signature &a, const Signature &b)
+{
+  typedef SignatureTraits<Signature> Traits;
+  const uint64_t *aWords = Traits::data(a);
+  const uint64_t *bWords = Traits::data(b);
+  size_t dist = 0;
+  for (size_t w = 0; w < Traits::words; w++) {
+    uint64_t xoredSignatures = aWords[w] ^ bWords[w];
+    uint64_t evenBits = xoredSignatures & 0xAAAAAAAAAAAAAAAAULL;
+    uint64_t oddBits = xoredSignatures & 0x5555555555555555ULL;
+    uint64_t mismatches = (evenBits >> 1) | oddBits;
+    dist += __builtin_popcountll(mismatches);
+  }
+  return dist;
+}
+
+template<class Signature, class RNG>
+std::vector<Signature> createRandomSigs(RNG &&rng, const std::vector<Signature> &sigs)
+{
+  constexpr size_t clusterCount = 2;
+  std::vector<Signature> clusterSigs(clusterCount);
+  size_t signatureCount = sigs.size();
+  std::uniform_int_distribution<size_t> dist(0, signatureCount - 1);
+  bool finished = false;
+
+  // Kept in the order drawn (rather than in a hash set) so the result only
+  // depends on the rng
+  std::vector<Signature> uniqueSigs;
+  for (size_t i = 0; i < signatureCount; i++) {
+    size_t sig = dist(rng);
+    if (std::find(uniqueSigs.begin(), uniqueSigs.end(), sigs[sig]) == uniqueSigs.end()) {
+      uniqueSigs.push_back(sigs[sig]);
+    }
+    if (uniqueSigs.size() >= clusterCount) {
+      finished = true;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < uniqueSigs.size(); i++) {
+    clusterSigs[i] = uniqueSigs[i];
+  }
+
+  if (!finished) {
+    if (uniqueSigs.size() != 1) {
+      throw std::logic_error("This should not happen");
+    }
+    clusterSigs.push_back(clusterSigs[0]);
+  }
+
+  return clusterSigs;
+}
+
+inline std::vector<std::vector<size_t>> createClusterLists(const std::vector<size_t> &clusters)
+{
+  constexpr size_t clusterCount = 2;
+  std::vector<std::vector<size_t>> clusterLists(clusterCount);
+  for (size_t i = 0; i < clusters.size(); i++) {
+    clusterLists[clusters[i]].push_back(i);
+  }
+  return clusterLists;
+}
+
+template<class Signature>
+std::vector<Signature> createClusterSigs(const std::vector<std::vector<size_t>> &clusterLists, const std::vector<Signature> &sigs)
+{
+  constexpr size_t clusterCount = 2;
+  std::vector<Signature> clusterSigs(clusterCount);
+
+  for (size_t cluster = 0; cluster < clusterLists.size(); cluster++) {
+    size_t minAvgDist = std::numeric_limits<size_t>::max();
+    // Compare all of the sigs in the cluster against each other and find sig with lowest avg dist
+    for (size_t outterCount : clusterLists[cluster]) {
+      const Signature *sigToCalc = &sigs[outterCount];
+      double averageDist = 0;
+      for (size_t inneCount : clusterLists[cluster]) {
+        const Signature *sigInCluster = &sigs[outterCount];
+        // Don't include self
+        if (sigToCalc == sigInCluster) {
+          continue;
+        }
+        averageDist += signatureDistance(*sigToCalc, *sigInCluster);
+      }
+      averageDist /= clusterLists[cluster].size() - 1;
+      if (averageDist < minAvgDist) {
+        minAvgDist = averageDist;
+        clusterSigs[cluster] = *sigToCalc;
+      }
+    }
+  }
+  return clusterSigs;
+}
+
+template<class Signature>
+void reclusterSignatures(std::vector<size_t> &clusters, const std::vector<Signature> &meanSigs, const std::vector<Signature> &sigs)
+{
+  std::set<size_t> allClusters;
+  for (size_t sig = 0; sig < clusters.size(); sig++) {
+    const Signature *sourceSignature = &sigs[sig];
+    size_t minHdCluster = 0;
+    size_t minHd = std::numeric_limits<size_t>::max();
+
+    for (size_t cluster = 0; cluster < 2; cluster++) {
+      const Signature *clusterSignature = &meanSigs[cluster];
+      size_t hd = signatureDistance(*sourceSignature, *clusterSignature);
+      if (hd < minHd) {
+        minHd = hd;
+        minHdCluster = cluster;
+      }
+    }
+    clusters[sig] = minHdCluster;
+    allClusters.insert(minHdCluster);
+  }
+
+  if (allClusters.size() == 1) {
+    // We can't have everything in the same cluster.
+    // If this did happen, just split them evenly
+    for (size_t sig = 0; sig < clusters.size(); sig++) {
+      clusters[sig] = sig % 2;
+    }
+  }
+}
+
+// Renumber cluster IDs to 0..n-1 in order of first appearance, returning n
+inline size_t compressClusterList(std::vector<size_t> &clusters)
+{
+  std::unordered_map<size_t, size_t> remap;
+  for (size_t &clus : clusters) {
+    if (remap.count(clus)) {
+      clus = remap[clus];
+    } else {
+      size_t newClus = remap.size();
+      remap[clus] = newClus;
+      clus = newClus;
+    }
+  }
+  return remap.size();
+}
+
+// Pick sampleSize distinct signature indices uniformly at random (selection sampling),
+// returned in shuffled order so the skeleton isn't biased by input ordering
+template<class RNG>
+std::vector<size_t> sampleSignatures(RNG &&rng, size_t sigCount, size_t sampleSize)
+{
+  std::vector<size_t> sample;
+  sample.reserve(sampleSize);
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  for (size_t i = 0; i < sigCount && sample.size() < sampleSize; i++) {
+    size_t needed = sampleSize - sample.size();
+    size_t remaining = sigCount - i;
+    if (dist(rng) * remaining < needed) {
+      sample.push_back(i);
+    }
+  }
+  std::shuffle(sample.begin(), sample.end(), rng);
+  return sample;
+}
+
+// Seed for the rng used by the index'th insert in deterministic mode (splitmix64)
+inline uint64_t insertionSeed(uint64_t index)
+{
+  uint64_t z = index + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Timings from a parallel batch insert
+struct BatchStats {
+  size_t inserted = 0;   // signatures inserted by the batch
+  size_t earlyCount = 0; // size of the early window (first 1% of the batch)
+  double earlyTime = 0;  // seconds taken to get through the early window
+  double totalTime = 0;  // seconds taken for the whole batch
+};
+
+// There are two kinds of ktree nodes- branch nodes and leaf nodes
+// Both contain a signature matrix, plus their own signature
+// (the root node signature does not matter and can be blank)
+// Branch nodes then contain 'order' links to other nodes
+// Leaf nodes do not.
+// However, as leaf nodes may become branch nodes, we allocate
+// the space anyway.
+// As the space to be used is determined at runtime, we use
+// parallel arrays, not structs
+//
+// Order can be fixed at compile time through the Order parameter, which lets
+// the matrix height and the per-node loops be specialised. Order = 0 means the
+// order is only known at runtime.
+
+template<class Signature = uint64_t, size_t Order = 0>
+struct KTree {
+  typedef SignatureTraits<Signature> Traits;
+  static constexpr size_t sigBits = Traits::words * 64; // bits in a signature (matrix rows)
+  static constexpr size_t staticOrder = Order;
+
+  size_t root = std::numeric_limits<size_t>::max(); // # of root node
+  std::vector<size_t> childCounts; // n entries, number of children
+  std::vector<int> isBranchNode; // n entries, is this a branch node
+  std::vector<size_t> childLinks; // n * o entries, links to children
+  std::vector<size_t> parentLinks; // n entries, links to parents
+  std::vector<Signature> means; // n entries, node signatures
+  std::vector<uint64_t> matrices; // n * (o / 64) * sigBits entries
+  std::vector<omp_lock_t> locks; // n locks
+  std::vector<size_t> freeNodes; // unallocated nodes, popped from the back lowest first
+  std::default_random_engine rng; // used by single-threaded inserts
+  size_t order_;
+  size_t capacity = 0; // Set during construction, currently can't change
+  size_t matrixHeight_;
+
+  size_t order() const { return Order ? Order : order_; }
+  size_t matrixHeight() const { return Order ? (Order + 63) / 64 : matrixHeight_; }
+  size_t matrixSize() const { return matrixHeight() * sigBits; }
+
+  void reserve(size_t capacity) {
+    // For safety, only call this at startup currently
+    if (this->capacity != 0) {
+      throw std::logic_error("Reserve can only be called from 0 capacity");
+    }
+    this->capacity = capacity;
+    matrixHeight_ = (order() + 63) / 64;
+
+    #pragma omp parallel
+    {
+      #pragma omp single
+      {
+        childCounts.resize(capacity);
+      }
+      #pragma omp single
+      {
+        isBranchNode.resize(capacity);
+      }
+      #pragma omp single
+      {
+        childLinks.resize(capacity * order());
+      }
+      #pragma omp single
+      {
+        parentLinks.resize(capacity);
+      }
+      #pragma omp single
+      {
+        locks.resize(capacity);
+      }
+      #pragma omp single
+      {
+        matrices.resize(capacity * matrixSize());
+      }
+      #pragma omp single
+      {
+        means.resize(capacity);
+      }
+      #pragma omp single
+      {
+        freeNodes.resize(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+          freeNodes[i] = capacity - i - 1;
+        }
+      }
+    }
+  }
+
+  KTree(size_t order, size_t capacity) : order_{order} {
+    if (Order != 0 && order != Order) {
+      throw std::invalid_argument("KTree order " + std::to_string(order) + " does not match compiled order " + std::to_string(Order));
+    }
+    reserve(capacity);
+  }
+
+  explicit KTree(size_t capacity) : KTree(Order, capacity) {}
+
+  // Each node owns a lock, so trees can't be copied
+  KTree(const KTree &) = delete;
+  KTree &operator=(const KTree &) = delete;
+
+  ~KTree()
+  {
+    destroyAllocatedLocks();
+  }
+
+  // Destroy the lock of every node that has been handed out, whether or not it
+  // is still reachable from the root (aborted splits can orphan nodes)
+  void destroyAllocatedLocks()
+  {
+    std::vector<char> isFree(capacity, 0);
+    for (size_t node : freeNodes) {
+      isFree[node] = 1;
+    }
+    for (size_t node = 0; node < capacity; node++) {
+      if (!isFree[node]) omp_destroy_lock(&locks[node]);
+    }
+  }
+
+  size_t calcDist(const Signature *a, const Signature *b) const
+  {
+    return signatureDistance(*a, *b);
+  }
+
+  // Find where in the tree to insert the PARAM signature by traversing the tree.
+  // If depth is given it is set to the number of branch nodes passed through.
+  size_t traverse(const Signature *signature, size_t *depth = nullptr) const
+  {
+    size_t node = root;
+    if (depth) *depth = 0;
+    while (isBranchNode[node]) {
+      if (depth) (*depth)++;
+      size_t lowestDist = std::numeric_limits<size_t>::max();
+      size_t lowestDistChild = 0;
+
+      for (size_t i = 0; i < childCounts[node]; i++) {
+        size_t child = childLinks[node * order() + i];
+        size_t dist = calcDist(&means[child], signature);
+        if (dist < lowestDist) {
+          lowestDist = dist;
+          lowestDistChild = child;
+        }
+      }
+      node = lowestDistChild;
+    }
+    return node;
+  }
+
+  // A method of store all signatures in a matrix. Can be used to extact all signautes in this node
+  void addSigToMatrix(uint64_t *matrix, size_t child, const Signature *sig) const
+  {
+    size_t childPos = child / 64;
+    size_t childOff = child % 64;
+    const uint64_t *sigWords = Traits::data(*sig);
+
+    //fprintf(stderr, "Adding this signature:\n");
+    //dbgPrintSignature(sig);
+    //fprintf(stderr, "To this matrix:\n");
+    //dbgPrintMatrix(matrix);
+
+    for (size_t i = 0; i < sigBits; i++) {
+      matrix[i * matrixHeight() + childPos] |= ((sigWords[i / 64] >> (i % 64)) & 0x01) << childOff;
+    }
+    //fprintf(stderr, "Resulting in:\n");
+    //dbgPrintMatrix(matrix);
+  }
+
+  void removeSigFromMatrix(uint64_t *matrix, size_t child) const
+  {
+    size_t childPos = child / 64;
+    size_t childOff = child % 64;
+
+    uint64_t mask = ~(1ull << childOff);
+
+    //fprintf(stderr, "Removing the %zuth child from matrix\n", child);
+    for (size_t i = 0; i < sigBits; i++) {
+      matrix[i * matrixHeight() + childPos] &= mask;
+    }
+    //fprintf(stderr, "Resulting in:\n");
+    //dbgPrintMatrix(matrix);
+  }
+
+  // Read the child'th signature back out of a node's matrix
+  void getSigFromMatrix(const uint64_t *matrix, size_t child, Signature *sig) const
+  {
+    uint64_t *sigWords = Traits::data(*sig);
+    for (size_t j = 0; j < sigBits; j++) {
+      sigWords[j / 64] |= ((matrix[j * matrixHeight() + child / 64] >> (child % 64)) & 1) << (j % 64);
+    }
+  }
+
+  void dbgPrintMatrix(const uint64_t *matrix) const
+  {
+    for (size_t i = 0; i < sigBits; i++) {
+      fprintf(stderr, "%03zu:", i);
+      for (size_t j = 0; j < matrixHeight() * 64; j++) {
+        auto val = matrix[i * matrixHeight() + (j / 64)];
+        if (val & (1ull << (j % 64))) {
+          fprintf(stderr, "1");
+        } else {
+          fprintf(stderr, "0");
+        }
+      }
+      fprintf(stderr, "\n");
+      if (i >= 5) {
+        fprintf(stderr, "...............\n");
+        break;
+      }
+    }
+  }
+
+  void recalculateSig(size_t node)
+  {
+    size_t nodeSigCount = childCounts[node];
+    std::vector<Signature> sigs(nodeSigCount);
+    for (int i = 0; i < nodeSigCount; i++) {
+      getSigFromMatrix(&matrices[node * matrixSize()], i, &sigs[i]);
+    }
+
+    size_t minAvgDist = std::numeric_limits<size_t>::max();
+    Signature *meanSig = &means[node];
+    // Compare all of the sigs in the cluster against each other and find sig with lowest avg dist
+    for (const Signature& sigToCalc : sigs) {
+      double averageDist = 0;
+      for (const Signature& sigInCluster : sigs) {
+        // Don't include self
+        if (sigToCalc == sigInCluster) {
+          continue;
+        }
+        averageDist += signatureDistance(sigToCalc, sigInCluster);
+      }
+      averageDist /= nodeSigCount - 1;
+      if (averageDist < minAvgDist) {
+        minAvgDist = averageDist;
+        *meanSig = sigToCalc;
+      }
+    }
+  }
+
+  // From node, recalculate node middle points
+  void recalculateUp(size_t node)
+  {
+    size_t limit = 10;
+    //fprintf(stderr, "RecalculateUp %zu\n", node);
+    while (node != root) {
+      recalculateSig(node);
+      node = parentLinks[node];
+      if (omp_test_lock(&locks[node])) {
+        omp_unset_lock(&locks[node]);
+      } else {
+        break;
+      }
+
+      // Put a limit on how far we go up
+      // At some point it stops mattering, plus this helps avoid inf loops
+      // caused by cycles getting into the tree structure
+      limit--;
+      if (limit == 0) return;
+      //fprintf(stderr, "-> %zu\n", node);
+    }
+  }
+
+  size_t getNewNodeIdx(std::vector<size_t> &insertionList)
+  {
+    if (insertionList.empty()) {
+      throw std::runtime_error("ran out of insertion points");
+    }
+    size_t idx = insertionList.back();
+    insertionList.pop_back();
+
+    // Initialise lock
+    omp_init_lock(&locks[idx]);
+    return idx;
+  }
+
+  template<class RNG>
+  void splitNode(RNG &&rng, size_t node, const Signature *sig, std::vector<size_t> &insertionList, size_t link)
+  {
+    //fprintf(stderr, "Splitting node %zu\n", node);
+    // Add 'sig' to the current node, splitting it in the process
+    //fprintf(stderr, "Adding signature:\n");
+    //dbgPrintSignature(sig);
+    size_t nodeSigs = childCounts[node] + 1; // Plus 1 to include new param *sig
+    std::vector<Signature> sigs(nodeSigs);
+    sigs[childCounts[node]] = *sig; // Add to end
+
+    for (int i = 0; i < childCounts[node]; i++) {
+      getSigFromMatrix(&matrices[node * matrixSize()], i, &sigs[i]);
+    }
+
+    std::vector<Signature> meanSigs = createRandomSigs(rng, sigs);
+    std::vector<size_t> clusters(nodeSigs);
+    std::vector<std::vector<size_t>> clusterLists;
+    for (int iteration = 0; iteration < 4; iteration++) {
+      //fprintf(stderr, "Iteration %d\n", iteration);
+      reclusterSignatures(clusters, meanSigs, sigs);
+      clusterLists = createClusterLists(clusters);
+      meanSigs = createClusterSigs(clusterLists, sigs);
+    }
+
+    // Create the sibling node
+    size_t sibling = getNewNodeIdx(insertionList);
+
+    size_t newlyAddedIdx = childCounts[node];
+
+    childCounts[sibling] = clusterLists[1].size();
+    isBranchNode[sibling] = isBranchNode[node];
+    {
+      size_t siblingIdx = 0;
+      for (size_t seqIdx : clusterLists[1]) {
+        if (seqIdx < newlyAddedIdx) {
+          childLinks[sibling * order() + siblingIdx] = childLinks[node * order() + seqIdx];
+        } else {
+          childLinks[sibling * order() + siblingIdx] = link;
+        }
+        // If this is a branch node, relink the child to the new parent
+        if (isBranchNode[sibling]) {
+          parentLinks[childLinks[sibling * order() + siblingIdx]] = sibling;
+        }
+        addSigToMatrix(&matrices[sibling * matrixSize()], siblingIdx, &sigs[seqIdx]);
+        siblingIdx++;
+      }
+    }
+    means[sibling] = meanSigs[1];
+
+    // Fill the current node with the other cluster of signatures
+    {
+      std::fill(&matrices[node * matrixSize()], &matrices[node * matrixSize()] + matrixSize(), 0ull);
+      size_t nodeIdx = 0;
+      for (size_t seqIdx : clusterLists[0]) {
+        if (seqIdx < newlyAddedIdx) {
+          childLinks[node * order() + nodeIdx] = childLinks[node * order() + seqIdx];
+        } else {
+          childLinks[node * order() + nodeIdx] = link;
+        }
+        // If this is a branch node, relink the child to the new parent
+        if (isBranchNode[node]) {
+          parentLinks[childLinks[node * order() + nodeIdx]] = node;
+        }
+        addSigToMatrix(&matrices[node * matrixSize()], nodeIdx, &sigs[seqIdx]);
+        nodeIdx++;
+      }
+    }
+    childCounts[node] = clusterLists[0].size();
+
+    // Is this the root level?
+    if (node == root) {
+      //fprintf(stderr, "Node being split is root node\n");
+
+      // Create a new root node
+      size_t newRoot;
+      newRoot = getNewNodeIdx(insertionList);
+
+      // Link this node and the sibling to it
+      parentLinks[node] = newRoot;
+      parentLinks[sibling] = newRoot;
+
+      childCounts[newRoot] = 2;
+      isBranchNode[newRoot] = 1;
+      childLinks[newRoot * order() + 0] = node;
+      childLinks[newRoot * order() + 1] = sibling;
+      addSigToMatrix(&matrices[newRoot * matrixSize()], 0, &meanSigs[0]);
+      addSigToMatrix(&matrices[newRoot * matrixSize()], 1, &meanSigs[1]);
+
+      root = newRoot;
+    } else {
+
+      // First, update the reference to this node in the parent with the new mean
+      size_t parent = parentLinks[node];
+
+      // Lock the parent
+      omp_set_lock(&locks[parent]);
+
+      size_t idx = std::numeric_limits<size_t>::max();
+      for (size_t i = 0; i < childCounts[parent]; i++) {
+        if (childLinks[parent * order() + i] == node) {
+          idx = i;
+          break;
+        }
+      }
+      if (idx == std::numeric_limits<size_t>::max()) {
+        //fprintf(stderr, "Error: node %zu is not its parent's (%zu) child\n", node, parent);
+
+        // Abort. Unlock the parent and get out of here
+        omp_unset_lock(&locks[parent]);
+        return;
+
+        //exit(1);
+      }
+
+      removeSigFromMatrix(&matrices[parent * matrixSize()], idx);
+      addSigToMatrix(&matrices[parent * matrixSize()], idx, &meanSigs[0]);
+
+      // Connect sibling node to parent
+      parentLinks[sibling] = parent;
+
+      // Now add a link in the parent node to the sibling node
+      if (childCounts[parent] + 1 < order()) {
+        addSigToMatrix(&matrices[parent * matrixSize()], childCounts[parent], &meanSigs[1]);
+        childLinks[parent * order() + childCounts[parent]] = sibling;
+        childCounts[parent]++;
+
+        // Update signatures (may change?)
+        recalculateUp(parent);
+      } else {
+        splitNode(rng, parent, &meanSigs[1], insertionList, sibling);
+      }
+      // Unlock the parent
+      omp_unset_lock(&locks[parent]);
+    }
+
+    //fprintf(stderr, "Split finished\n");
+  }
+
+  template<class RNG>
+  void insert(RNG &&rng, const Signature *signature, std::vector<size_t> &insertionList)
+  {
+    // Warning: ALWAYS INSERT THE FIRST NODE SINGLE-THREADED
+    // We don't have any protection from this because it would slow everything down to do so
+    if (root == std::numeric_limits<size_t>::max()) {
+      root = getNewNodeIdx(insertionList);
+      childCounts[root] = 0;
+      isBranchNode[root] = 0;
+    }
+
+    size_t depth;
+    size_t insertionPoint = traverse(signature, &depth);
+
+    //fprintf(stderr, "Inserting at %zu\n", insertionPoint);
+    omp_set_lock(&locks[insertionPoint]);
+    // A split can cascade up to the root and add a new one, so check there are
+    // enough free nodes for that (allowing for the tree growing a level meanwhile)
+    // before going on to lock any parents
+    if (childCounts[insertionPoint] >= order() && insertionList.size() < depth + 3) {
+      omp_unset_lock(&locks[insertionPoint]);
+      throw std::runtime_error("ran out of insertion points");
+    }
+    if (childCounts[insertionPoint] < order()) {
+      addSigToMatrix(&matrices[insertionPoint * matrixSize()], childCounts[insertionPoint], signature);
+      childCounts[insertionPoint]++;
+    } else {
+      splitNode(rng, insertionPoint, signature, insertionList, 0);
+    }
+    omp_unset_lock(&locks[insertionPoint]);
+
+    //fprintf(stderr, "Node %zu now has %zu leaves\n", insertionPoint, childCounts[insertionPoint]);
+  }
+
+  // Single-threaded insert, taking new nodes straight from the free pool
+  void insert(const Signature *signature)
+  {
+    insert(rng, signature, freeNodes);
+  }
+
+  // Insert count signatures in parallel. Signatures with a nonzero entry in skip
+  // (if given) are left out, e.g. because they were already inserted as a seed.
+  // The free pool is split between the threads for the duration of the batch.
+  BatchStats insertBatch(const Signature *sigs, size_t count, const char *skip = nullptr)
+  {
+    BatchStats stats;
+    if (root == std::numeric_limits<size_t>::max()) {
+      size_t first = 0;
+      while (first < count && skip && skip[first]) first++;
+      if (first == count) return stats;
+      // The first insert has to be single-threaded
+      insert(&sigs[first]);
+      std::vector<char> rest(count, 0);
+      if (skip) std::copy(skip, skip + count, rest.begin());
+      rest[first] = 1;
+      stats = insertBatch(sigs, count, rest.data());
+      stats.inserted++;
+      return stats;
+    }
+
+    size_t batchCount = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!skip || !skip[i]) batchCount++;
+    }
+    stats.earlyCount = std::max<size_t>(1, batchCount / 100);
+    size_t insertedCount = 0;
+    double start = 0;
+
+    std::vector<size_t> pool;
+    pool.swap(freeNodes);
+
+    // Exceptions can't leave a parallel region, so the first one is kept, the
+    // remaining inserts are skipped, and it is rethrown afterwards
+    std::exception_ptr error;
+    bool failed = false;
+
+    #pragma omp parallel reduction(+:insertedCount)
+    {
+      std::default_random_engine rng;
+      std::vector<size_t> insertionList;
+
+      #pragma omp for
+      for (size_t i = 0; i < pool.size(); i++) {
+        insertionList.push_back(pool[i]);
+      }
+
+      // Handing out the pool takes time proportional to the capacity, so the
+      // clock only starts once every thread has its share
+      #pragma omp single
+      start = omp_get_wtime();
+
+      // Each thread times its own share of the early window, so nothing shared
+      // is touched per insert. The window is done once every thread is through
+      // its share.
+      size_t earlyShare = std::max<size_t>(1, stats.earlyCount / omp_get_num_threads());
+      double threadEarlyTime = 0;
+
+      #pragma omp for
+      for (size_t i = 0; i < count; i++) {
+        if (skip && skip[i]) continue;
+        bool stop;
+        #pragma omp atomic read
+        stop = failed;
+        if (stop) continue;
+        try {
+          insert(rng, &sigs[i], insertionList);
+        } catch (...) {
+          #pragma omp critical
+          if (!error) error = std::current_exception();
+          #pragma omp atomic write
+          failed = true;
+          continue;
+        }
+
+        insertedCount++;
+        if (insertedCount == earlyShare) {
+          threadEarlyTime = omp_get_wtime() - start;
+        }
+      }
+
+      // Hand whatever is left back to the pool
+      #pragma omp critical
+      {
+        freeNodes.insert(freeNodes.end(), insertionList.begin(), insertionList.end());
+        stats.earlyTime = std::max(stats.earlyTime, threadEarlyTime);
+      }
+    }
+    std::sort(freeNodes.begin(), freeNodes.end(), std::greater<size_t>());
+    if (error) std::rethrow_exception(error);
+
+    stats.inserted = insertedCount;
+    stats.totalTime = omp_get_wtime() - start;
+    return stats;
+  }
+
+  // Like insertBatch, but the resulting tree only depends on the input, not on
+  // the number of threads or how they are scheduled. Signatures are inserted in
+  // epochs: every signature in an epoch is first routed to a leaf against the
+  // tree as it stood at the start of the epoch, then each leaf is owned by a
+  // single thread which appends its signatures in index order. The first
+  // signature to reach each full leaf is held back and inserted single-threaded
+  // in index order afterwards, splitting the leaf, with an rng seeded from its
+  // index. Any others that reached a full leaf are routed again at the start of
+  // the next epoch, against the tree with those splits made.
+  BatchStats insertBatchDeterministic(const Signature *sigs, size_t count, const char *skip = nullptr)
+  {
+    BatchStats stats;
+    if (root == std::numeric_limits<size_t>::max()) {
+      size_t first = 0;
+      while (first < count && skip && skip[first]) first++;
+      if (first == count) return stats;
+      // The first insert has to be single-threaded
+      std::default_random_engine firstRng(insertionSeed(first));
+      insert(firstRng, &sigs[first], freeNodes);
+      std::vector<char> rest(count, 0);
+      if (skip) std::copy(skip, skip + count, rest.begin());
+      rest[first] = 1;
+      stats = insertBatchDeterministic(sigs, count, rest.data());
+      stats.inserted++;
+      return stats;
+    }
+
+    size_t batchCount = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!skip || !skip[i]) batchCount++;
+    }
+    stats.earlyCount = std::max<size_t>(1, batchCount / 100);
+    double start = omp_get_wtime();
+
+    enum { Appended, Split, Retry };
+    std::vector<size_t> epochSigs;
+    std::vector<size_t> retrySigs;
+    std::vector<size_t> leaves;
+    std::vector<char> outcome;
+    std::vector<char> splitting(capacity, 0);
+    size_t next = 0;
+    while (next < count || !retrySigs.empty()) {
+      // Scale the epoch with the tree, so each leaf sees about one new signature
+      // and few of them overflow. Signatures retried from the last epoch come
+      // first, which keeps the epoch in index order.
+      size_t epochSize = std::max<size_t>(1024, capacity - freeNodes.size());
+      epochSigs.swap(retrySigs);
+      retrySigs.clear();
+      for (; next < count && epochSigs.size() < epochSize; next++) {
+        if (!skip || !skip[next]) epochSigs.push_back(next);
+      }
+      size_t epochCount = epochSigs.size();
+      leaves.resize(epochCount);
+      outcome.assign(epochCount, Appended);
+
+      #pragma omp parallel
+      {
+        #pragma omp for schedule(static)
+        for (size_t e = 0; e < epochCount; e++) {
+          leaves[e] = traverse(&sigs[epochSigs[e]]);
+        }
+
+        // Leaves are shared out by number, so no two threads touch the same leaf
+        size_t threadCount = omp_get_num_threads();
+        size_t thread = omp_get_thread_num();
+        for (size_t e = 0; e < epochCount; e++) {
+          size_t leaf = leaves[e];
+          if (leaf % threadCount != thread) continue;
+          if (childCounts[leaf] < order()) {
+            addSigToMatrix(&matrices[leaf * matrixSize()], childCounts[leaf], &sigs[epochSigs[e]]);
+            childCounts[leaf]++;
+          } else if (!splitting[leaf]) {
+            splitting[leaf] = 1;
+            outcome[e] = Split;
+          } else {
+            outcome[e] = Retry;
+          }
+        }
+      }
+
+      // Only the splits themselves run single-threaded
+      size_t before = stats.inserted;
+      for (size_t e = 0; e < epochCount; e++) {
+        if (outcome[e] == Retry) {
+          retrySigs.push_back(epochSigs[e]);
+          continue;
+        }
+        if (outcome[e] == Split) {
+          splitting[leaves[e]] = 0;
+          std::default_random_engine rng(insertionSeed(epochSigs[e]));
+          insert(rng, &sigs[epochSigs[e]], freeNodes);
+        }
+        stats.inserted++;
+      }
+      if (before < stats.earlyCount && stats.inserted >= stats.earlyCount) {
+        stats.earlyTime = omp_get_wtime() - start;
+      }
+    }
+
+    stats.totalTime = omp_get_wtime() - start;
+    return stats;
+  }
+
+  // Find the leaf each signature belongs to
+  std::vector<size_t> classify(const Signature *sigs, size_t count) const
+  {
+    std::vector<size_t> leaves(count);
+    #pragma omp parallel for
+    for (size_t i = 0; i < count; i++) {
+      leaves[i] = traverse(&sigs[i]);
+    }
+    return leaves;
+  }
+
+  // Assign each signature to a cluster, numbered 0..n-1 in order of first appearance
+  std::vector<size_t> extractClusters(const Signature *sigs, size_t count) const
+  {
+    std::vector<size_t> clusters = classify(sigs, count);
+    compressClusterList(clusters);
+    return clusters;
+  }
+
+  // Renumber the nodes reachable from the root in breadth-first order and drop
+  // every unused slot, so the upper levels sit together at the front of the arrays
+  // and parents come before their children. Only call this once building has finished.
+  void compact()
+  {
+    if (root == std::numeric_limits<size_t>::max()) return;
+
+    std::vector<size_t> remap(capacity, std::numeric_limits<size_t>::max());
+    std::vector<size_t> bfsNodes(1, root);
+    std::vector<size_t> bfsParents(1, std::numeric_limits<size_t>::max());
+    remap[root] = 0;
+    for (size_t head = 0; head < bfsNodes.size(); head++) {
+      size_t node = bfsNodes[head];
+      if (!isBranchNode[node]) continue;
+      for (size_t i = 0; i < childCounts[node]; i++) {
+        size_t child = childLinks[node * order() + i];
+        // Guard against a child being linked twice (or cycles) by only taking the first link
+        if (remap[child] == std::numeric_limits<size_t>::max()) {
+          remap[child] = bfsNodes.size();
+          bfsNodes.push_back(child);
+          bfsParents.push_back(head);
+        }
+      }
+    }
+
+    size_t count = bfsNodes.size();
+    std::vector<size_t> newChildCounts(count);
+    std::vector<int> newIsBranchNode(count);
+    std::vector<size_t> newChildLinks(count * order());
+    std::vector<size_t> newParentLinks(count);
+    std::vector<Signature> newMeans(count);
+    std::vector<uint64_t> newMatrices(count * matrixSize());
+
+    #pragma omp parallel for
+    for (size_t idx = 0; idx < count; idx++) {
+      size_t node = bfsNodes[idx];
+      newChildCounts[idx] = childCounts[node];
+      newIsBranchNode[idx] = isBranchNode[node];
+      newParentLinks[idx] = bfsParents[idx];
+      newMeans[idx] = means[node];
+      std::memcpy(&newMatrices[idx * matrixSize()], &matrices[node * matrixSize()], matrixSize() * sizeof(uint64_t));
+      for (size_t i = 0; i < childCounts[node]; i++) {
+        size_t link = childLinks[node * order() + i];
+        newChildLinks[idx * order() + i] = isBranchNode[node] ? remap[link] : link;
+      }
+    }
+    destroyAllocatedLocks();
+
+    childCounts.swap(newChildCounts);
+    isBranchNode.swap(newIsBranchNode);
+    childLinks.swap(newChildLinks);
+    parentLinks.swap(newParentLinks);
+    means.swap(newMeans);
+    matrices.swap(newMatrices);
+
+    locks = std::vector<omp_lock_t>(count);
+    for (size_t idx = 0; idx < count; idx++) {
+      omp_init_lock(&locks[idx]);
+    }
+
+    root = 0;
+    capacity = count;
+    freeNodes.clear();
+  }
+};
+
+}
+
+#endif
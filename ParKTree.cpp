@@ -1,101 +1,20 @@
 #include <cstdio>
 #include <cstdlib>
-#include <cstdint>
-#include <cstring>
-#include <vector>
-#include <utility>
-#include <algorithm>
 #include <string>
-#include <random>
-#include <unordered_set>
-#include <unordered_map>
-#include <set>
+#include <vector>
+#include <memory>
 #include <omp.h>
 
-using namespace std;
+#include "ParKTree.h"
 
-/** Char to binary encoding */
-const vector<uint8_t> nucleotideIndex{ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,3 };
-const vector<char> signatureIndex{ 'A', 'C', 'G', 'T' };
+using namespace std;
+using namespace parktree;
 
 static float density;         // % of sequence set as bits
 static bool fastaOutput;      // Output fasta or csv
+static string groupedOutput;  // Grouped fasta file to write, if any
+static string clusterDir;     // Directory for per-cluster fasta files, if any
 
-vector<pair<string, string>> loadFasta(const char *path)
-{
-  vector<pair<string, string>> sequences;
-
-  FILE *fp = fopen(path, "r");
-  if (!fp) {
-    fprintf(stderr, "Failed to load %s\n", path);
-    exit(1);
-  }
-  for (;;) {
-    char seqNameBuf[8192];
-    if (fscanf(fp, " >%[^\n]\n", seqNameBuf) < 1) break;
-    string sequenceBuf;
-
-    for (;;) {
-      int c = fgetc(fp);
-      if (c == EOF || c == '>') {
-        ungetc(c, fp);
-        break;
-      }
-      if (isalpha(c)) {
-        sequenceBuf.push_back(c);
-      }
-    }
-    sequences.push_back(make_pair(string(seqNameBuf), sequenceBuf));
-  }
-  fclose(fp);
-
-  return sequences;
-}
-
-void generateSignature(uint64_t *output, const pair<string, string> &fasta)
-{
-  // Binary encode genetic string
-  string fastaSequence = fasta.second;
-  uint64_t sig = 0;
-  for (size_t j = 0; j < fastaSequence.length(); j++) {
-    char c = fastaSequence[j];
-    sig |= (uint64_t)(nucleotideIndex[c]) << (j * 2);
-  }
-  *output = sig;
-}
-
-vector<uint64_t> convertFastaToSignatures(const vector<pair<string, string>> &fasta)
-{
-  vector<uint64_t> output;
-  // Allocate space for the strings
-  output.resize(fasta.size());
-  // output.resize(fasta.size() * signatureSize);
-  
-  #pragma omp parallel for schedule(dynamic)
-  for (size_t i = 0; i < fasta.size(); i++) {
-    generateSignature(&output[i], fasta[i]);
-    // generateSignature(&output[signatureSize * i], fasta[i]);
-  }
-  
-  return output;
-}
-
-void outputClusters(const vector<size_t> &clusters)
-{
-  for (size_t sig = 0; sig < clusters.size(); sig++)
-  {
-    printf("%llu,%llu\n", static_cast<unsigned long long>(sig), static_cast<unsigned long long>(clusters[sig]));
-  }
-}
-
-void outputFastaClusters(const vector<size_t> &clusters, const vector<pair<string, string>> &fasta)
-{
-  fprintf(stderr, "Writing out %zu records\n", clusters.size());
-  for (size_t sig = 0; sig < clusters.size(); sig++)
-  {
-    printf(">%llu\n%s\n", static_cast<unsigned long long>(clusters[sig]), fasta[sig].second.c_str());
-  }
-}
 /*
 vector<size_t> clusterSignatures(const vector<uint64_t> &sigs)
 {
@@ -116,639 +35,483 @@ vector<size_t> clusterSignatures(const vector<uint64_t> &sigs)
 // Parameters
 size_t ktree_order = 10;
 size_t ktree_capacity = 1000000;
+size_t ktree_seed_sample = 10000;
+bool ktree_compact = false;
+bool ktree_autotune = false;
+bool ktree_deterministic = false;
+bool ktree_numa = false;
+size_t ktree_numa_nodes = 0; // 0 = one partition per detected NUMA node
+size_t ktree_autotune_sample = 50000;
+size_t ktree_autotune_cluster_size = 0; // 0 = the cluster size the requested order gives on the sample
 
-// void dbgPrintSignature(const uint64_t *sig)
-// {
-//   fprintf(stderr, "%p: ", sig);
-//   for (size_t i = 0; i < 64; i++) {
-//   // for (size_t i = 0; i < signatureSize * 64; i++) {
-//     if (sig[i / 64] & (1ull << (i % 64))) {
-//       fprintf(stderr, "1");
-//     } else {
-//       fprintf(stderr, "0");
-//     }
-//   }
-//   fprintf(stderr, "\n");
-// }
-
-// Convert binary signature back to genetic string
-void dbgPrintSignature(const uint64_t *sig)
-{
-  fprintf(stderr, "%p: ", sig);
-  uint64_t signature  = *sig;
-  string sequence = string(20, ' ');
-  for (size_t j = 0; j < 20; j++) {
-    sequence[j] = signatureIndex[(signature >> (j * 2)) & 0x3];
-  }
-  fprintf(stderr, "%s", sequence.c_str());
-  fprintf(stderr, "\n");
-}
-
-void dbgPrintMatrix(const uint64_t *matrix)
-{
-  size_t ktree_csig_height = (ktree_order + 63) / 64;
-  for (size_t i = 0; i < 64; i++) {
-  // for (size_t i = 0; i < signatureSize * 64; i++) {
-    fprintf(stderr, "%03zu:", i);
-    for (size_t j = 0; j < ktree_csig_height * 64; j++) {
-      auto val = matrix[i * ktree_csig_height + (j / 64)];
-      if (val & (1ull << (j % 64))) {
-        fprintf(stderr, "1");
-      } else {
-        fprintf(stderr, "0");
-      }
-    }
-    fprintf(stderr, "\n");
-    if (i >= 5) {
-      fprintf(stderr, "...............\n");
-      break;
-    }
-  }
-}
-
-template<class RNG>
-vector<uint64_t> createRandomSigs(RNG &&rng, const vector<uint64_t> &sigs)
+// NUMA-aware build: the top level of the tree is partitioned across NUMA nodes.
+// A seed tree built from a sample provides the top-level medoids (the children of
+// its root), which are shared out between the nodes. Each node then gets its own
+// KTree, allocated and filled by threads pinned to that node, and every signature
+// goes to the node owning its nearest top-level medoid. Partitions share no tree
+// nodes, so no locks or splits ever cross between nodes.
+template<size_t Order>
+vector<size_t> clusterSignaturesNuma(const vector<uint64_t> &sigs)
 {
-  constexpr size_t clusterCount = 2;
-  vector<uint64_t> clusterSigs(clusterCount);
-  size_t signatureCount = sigs.size();
-  uniform_int_distribution<size_t> dist(0, signatureCount - 1);
-  bool finished = false;
-  
-  unordered_set<string> uniqueSigs;
-  for (size_t i = 0; i < signatureCount; i++) {
-    size_t sig = dist(rng);
-    string sigData(sizeof(uint64_t), ' ');
-    memcpy(&sigData[0], &sigs[sig], sizeof(uint64_t));
-    uniqueSigs.insert(sigData);
-    if (uniqueSigs.size() >= clusterCount) {
-      finished = true;
-      break;
-    }
+  typedef KTree<uint64_t, Order> Tree;
+  size_t sigCount = sigs.size();
+  if (sigCount == 0) {
+    fprintf(stderr, "Output 0 clusters\n");
+    return vector<size_t>();
   }
-  
-  size_t i = 0;
-  for (const auto &sig : uniqueSigs) {
-    memcpy(&clusterSigs[i], sig.data(), sizeof(uint64_t));
-    i++;
+  vector<vector<int>> nodeCpus = numaNodeCpus();
+  size_t requestedPartitions = ktree_numa_nodes ? ktree_numa_nodes : nodeCpus.size();
+  size_t partitionCount = max<size_t>(1, min<size_t>(requestedPartitions, omp_get_max_threads()));
+  if (partitionCount < requestedPartitions) {
+    fprintf(stderr, "Only %d threads, using %zu partitions rather than %zu\n", omp_get_max_threads(), partitionCount, requestedPartitions);
   }
   
-  if (!finished) {
-    if (uniqueSigs.size() != 1) {
-      fprintf(stderr, "This should not happen\n");
-      exit(1);
+  // Build a tree over a sample to find the top-level medoids
+  default_random_engine rng;
+  vector<size_t> seedSample = sampleSignatures(rng, sigCount, max<size_t>(1, min(ktree_seed_sample, sigCount)));
+  vector<uint64_t> medoids;
+  {
+    Tree seedTree(ktree_order, 2 * seedSample.size() + 1);
+    for (size_t sig : seedSample) {
+      seedTree.insert(rng, &sigs[sig], seedTree.freeNodes);
     }
-    clusterSigs.push_back(clusterSigs[0]);
-  }
-  
-  return clusterSigs;
-}
-
-vector<vector<size_t>> createClusterLists(const vector<size_t> &clusters)
-{
-  constexpr size_t clusterCount = 2;
-  vector<vector<size_t>> clusterLists(clusterCount);
-  for (size_t i = 0; i < clusters.size(); i++) {
-    clusterLists[clusters[i]].push_back(i);
-  }
-  return clusterLists;
-}
-
-vector<uint64_t> createClusterSigs(const vector<vector<size_t>> &clusterLists, const vector<uint64_t> &sigs)
-{
-  constexpr size_t clusterCount = 2;
-  vector<uint64_t> clusterSigs(clusterCount);
-
-  for (size_t cluster = 0; cluster < clusterLists.size(); cluster++) {
-    size_t minAvgDist = numeric_limits<size_t>::max();
-    // Compare all of the sigs in the cluster against each other and find sig with lowest avg dist
-    for (size_t outterCount : clusterLists[cluster]) {
-      const uint64_t *sigToCalc = &sigs[outterCount];
-      double averageDist = 0;
-      for (size_t inneCount : clusterLists[cluster]) {
-        const uint64_t *sigInCluster = &sigs[outterCount];
-        // Don't include self
-        if (sigToCalc == sigInCluster) {
-          continue;
-        }
-        uint64_t xoredSignatures = *sigToCalc ^ *sigInCluster;
-        uint64_t evenBits = xoredSignatures & 0xAAAAAAAAAAAAAAAAULL;
-        uint64_t oddBits = xoredSignatures & 0x5555555555555555ULL;
-        uint64_t mismatches = (evenBits >> 1) | oddBits;
-        averageDist += __builtin_popcountll(mismatches);
-      }
-      averageDist /= clusterLists[cluster].size() - 1;
-      if (averageDist < minAvgDist) {
-        minAvgDist = averageDist;
-        clusterSigs[cluster] = *sigToCalc;
-      }
-    }  
-  }
-  return clusterSigs;
-}
-
-void reclusterSignatures(vector<size_t> &clusters, const vector<uint64_t> &meanSigs, const vector<uint64_t> &sigs)
-{
-  set<size_t> allClusters;
-  for (size_t sig = 0; sig < clusters.size(); sig++) {
-    const uint64_t *sourceSignature = &sigs[sig];
-    size_t minHdCluster = 0;
-    size_t minHd = numeric_limits<size_t>::max();
-
-    for (size_t cluster = 0; cluster < 2; cluster++) {
-      const uint64_t *clusterSignature = &meanSigs[cluster];
-      uint64_t xoredSignatures = *sourceSignature ^ *clusterSignature;
-      uint64_t evenBits = xoredSignatures & 0xAAAAAAAAAAAAAAAAULL;
-      uint64_t oddBits = xoredSignatures & 0x5555555555555555ULL;
-      uint64_t mismatches = (evenBits >> 1) | oddBits;
-      size_t hd = __builtin_popcountll(mismatches);
-      if (hd < minHd) {
-        minHd = hd;
-        minHdCluster = cluster;
+    size_t root = seedTree.root;
+    if (seedTree.isBranchNode[root]) {
+      for (size_t i = 0; i < seedTree.childCounts[root]; i++) {
+        uint64_t medoid = 0;
+        seedTree.getSigFromMatrix(&seedTree.matrices[root * seedTree.matrixSize()], i, &medoid);
+        medoids.push_back(medoid);
       }
     }
-    clusters[sig] = minHdCluster;
-    allClusters.insert(minHdCluster);
   }
-  
-  if (allClusters.size() == 1) {
-    // We can't have everything in the same cluster.
-    // If this did happen, just split them evenly
-    for (size_t sig = 0; sig < clusters.size(); sig++) {
-      clusters[sig] = sig % 2;
-    }
+  if (medoids.size() < partitionCount) {
+    fprintf(stderr, "Only %zu top-level medoids, using a single partition\n", medoids.size());
+    partitionCount = 1;
+    if (medoids.empty()) medoids.push_back(sigs[seedSample[0]]);
   }
-}
-
-// There are two kinds of ktree nodes- branch nodes and leaf nodes
-// Both contain a signature matrix, plus their own signature
-// (the root node signature does not matter and can be blank)
-// Branch nodes then contain 'order' links to other nodes
-// Leaf nodes do not.
-// However, as leaf nodes may become branch nodes, we allocate
-// the space anyway.
-// As the space to be used is determined at runtime, we use
-// parallel arrays, not structs
-
-struct KTree {
-  size_t root = numeric_limits<size_t>::max(); // # of root node
-  vector<size_t> childCounts; // n entries, number of children
-  vector<int> isBranchNode; // n entries, is this a branch node
-  vector<size_t> childLinks; // n * o entries, links to children
-  vector<size_t> parentLinks; // n entries, links to parents
-  vector<uint64_t> means; // n * signatureSize entries, node signatures
-  vector<uint64_t> matrices; // n * (o / 64) * signatureSize * 64 entries
-  vector<omp_lock_t> locks; // n locks
-  size_t order;
-  size_t capacity = 0; // Set during construction, currently can't change
-  size_t matrixHeight;
-  size_t matrixSize;
-  
-  void reserve(size_t capacity) {
-    // For safety, only call this at startup currently
-    if (this->capacity != 0) {
-      fprintf(stderr, "Reserve can only be called from 0 capacity\n");
-      exit(1);
-    }
-    this->capacity = capacity;
-    matrixHeight = (order + 63) / 64;
-    matrixSize = matrixHeight * 64;
-    
-    #pragma omp parallel
-    {
-      #pragma omp single
-      {
-        childCounts.resize(capacity);
-      }
-      #pragma omp single
-      {
-        isBranchNode.resize(capacity);
-      }
-      #pragma omp single
-      {
-        childLinks.resize(capacity * order);
-      }
-      #pragma omp single
-      {
-        parentLinks.resize(capacity);
-      }
-      #pragma omp single
-      {
-        locks.resize(capacity);
-      }
-      #pragma omp single
-      {
-        matrices.resize(capacity * matrixSize);
-      }
-      #pragma omp single
-      {
-        means.resize(capacity);
+  
+  auto nearestMedoid = [&](const uint64_t &sig) {
+    size_t nearest = 0;
+    size_t lowestDist = numeric_limits<size_t>::max();
+    for (size_t m = 0; m < medoids.size(); m++) {
+      size_t dist = signatureDistance(medoids[m], sig);
+      if (dist < lowestDist) {
+        lowestDist = dist;
+        nearest = m;
       }
     }
-  }
+    return nearest;
+  };
   
-  KTree(size_t order_, size_t capacity) : order{order_} {    
-    reserve(capacity);
+  // Balance the medoids between partitions by how much of the sample each one
+  // attracts, biggest first
+  vector<size_t> medoidLoad(medoids.size(), 0);
+  for (size_t sig : seedSample) {
+    medoidLoad[nearestMedoid(sigs[sig])]++;
+  }
+  vector<size_t> medoidOrder(medoids.size());
+  for (size_t m = 0; m < medoids.size(); m++) medoidOrder[m] = m;
+  stable_sort(medoidOrder.begin(), medoidOrder.end(), [&](size_t a, size_t b) { return medoidLoad[a] > medoidLoad[b]; });
+  vector<size_t> medoidPartition(medoids.size());
+  vector<size_t> partitionLoad(partitionCount, 0);
+  for (size_t m : medoidOrder) {
+    size_t partition = min_element(partitionLoad.begin(), partitionLoad.end()) - partitionLoad.begin();
+    medoidPartition[m] = partition;
+    partitionLoad[partition] += medoidLoad[m] + 1;
   }
   
-  size_t calcDist(const uint64_t *a, const uint64_t *b) const
-  {
-    uint64_t xoredSignatures = *a ^ *b;
-    uint64_t evenBits = xoredSignatures & 0xAAAAAAAAAAAAAAAAULL;
-    uint64_t oddBits = xoredSignatures & 0x5555555555555555ULL;
-    uint64_t mismatches = (evenBits >> 1) | oddBits;
-    return __builtin_popcountll(mismatches);
+  vector<size_t> partitionOf(sigCount);
+  #pragma omp parallel for
+  for (size_t i = 0; i < sigCount; i++) {
+    partitionOf[i] = medoidPartition[nearestMedoid(sigs[i])];
   }
+  ClusterGroups partitions = groupByCluster(partitionOf);
+  auto partitionBegin = [&](size_t partition) { return partitions.offsets[min(partition, partitions.clusterCount())]; };
   
-  // Find where in the tree to insert the PARAM signature by traversing the tree.
-  size_t traverse(const uint64_t *signature) const
-  {
-    size_t node = root;
-    while (isBranchNode[node]) {
-      size_t lowestDist = numeric_limits<size_t>::max();
-      size_t lowestDistChild = 0;
-      
-      for (size_t i = 0; i < childCounts[node]; i++) {
-        size_t child = childLinks[node * order + i];
-        size_t dist = calcDist(&means[child], signature);
-        if (dist < lowestDist) {
-          lowestDist = dist;
-          lowestDistChild = child;
-        }
-      }
-      node = lowestDistChild;
-    }
-    return node;
+  // Size each arena by its share of the input
+  vector<size_t> capacities(partitionCount);
+  for (size_t partition = 0; partition < partitionCount; partition++) {
+    size_t partitionSigs = partitionBegin(partition + 1) - partitionBegin(partition);
+    double share = static_cast<double>(partitionSigs) / max<size_t>(sigCount, 1);
+    capacities[partition] = min(ktree_capacity, static_cast<size_t>(ktree_capacity * share * 1.25) + 2 * seedSample.size() + 1024);
   }
   
-  // A method of store all signatures in a matrix. Can be used to extact all signautes in this node
-  void addSigToMatrix(uint64_t *matrix, size_t child, const uint64_t *sig) const
-  {
-    size_t childPos = child / 64;
-    size_t childOff = child % 64;
-    
-    //fprintf(stderr, "Adding this signature:\n");
-    //dbgPrintSignature(sig);
-    //fprintf(stderr, "To this matrix:\n");
-    //dbgPrintMatrix(matrix);
-    
-    for (size_t i = 0; i < 64; i++) {
-    //for (size_t i = 0; i < signatureSize * 64; i++) {
-      matrix[i * matrixHeight + childPos] |= ((sig[i / 64] >> (i % 64)) & 0x01) << childOff;
-    }
-    //fprintf(stderr, "Resulting in:\n");
-    //dbgPrintMatrix(matrix);
-  }
-
-  void removeSigFromMatrix(uint64_t *matrix, size_t child) const
-  {
-    size_t childPos = child / 64;
-    size_t childOff = child % 64;
-    
-    uint64_t mask = ~(1ull << childOff);
-    
-    //fprintf(stderr, "Removing the %zuth child from matrix\n", child);    
-    for (size_t i = 0; i < 64; i++) {
-      matrix[i * matrixHeight + childPos] &= mask;
-    }
-    //fprintf(stderr, "Resulting in:\n");
-    //dbgPrintMatrix(matrix);
+  vector<char> seeded(sigCount, 0);
+  vector<size_t> seededCounts(partitionCount, 0);
+  for (size_t sig : seedSample) {
+    seeded[sig] = 1;
+    seededCounts[partitionOf[sig]]++;
   }
   
-  void recalculateSig(size_t node)
-  {
-    size_t nodeSigCount = childCounts[node];
-    vector<uint64_t> sigs(nodeSigCount);
-    for (int i = 0; i < childCounts[node]; i++) {
-      uint64_t *currentSig = &sigs[i];
-      uint64_t *matrix = &matrices[node * matrixSize];
-      for (size_t j = 0; j < 64; j++) {
-        currentSig[j / 64] |= ((matrix[j * matrixHeight + i / 64] >> (i % 64)) & 1) << (j % 64);
-      }
-    }
-
-    size_t minAvgDist = numeric_limits<size_t>::max();
-    uint64_t *meanSig = &means[node];
-    // Compare all of the sigs in the cluster against each other and find sig with lowest avg dist
-    for (const uint64_t& sigToCalc : sigs) {
-      double averageDist = 0;
-      for (const uint64_t& sigInCluster : sigs) {
-        // Don't include self
-        if (sigToCalc == sigInCluster) {
-          continue;
-        }
-        uint64_t xoredSignatures = sigToCalc ^ sigInCluster;
-        uint64_t evenBits = xoredSignatures & 0xAAAAAAAAAAAAAAAAULL;
-        uint64_t oddBits = xoredSignatures & 0x5555555555555555ULL;
-        uint64_t mismatches = (evenBits >> 1) | oddBits;
-        averageDist += __builtin_popcountll(mismatches);
-      }
-      averageDist /= nodeSigCount - 1;
-      if (averageDist < minAvgDist) {
-        minAvgDist = averageDist;
-        *meanSig = sigToCalc;
-      }
-    }
-  }
-
-  // From node, recalculate node middle points
-  void recalculateUp(size_t node)
-  {
-    size_t limit = 10;
-    //fprintf(stderr, "RecalculateUp %zu\n", node);
-    while (node != root) {
-      recalculateSig(node);
-      node = parentLinks[node];
-      if (omp_test_lock(&locks[node])) {
-        omp_unset_lock(&locks[node]);
-      } else {
-        break;
-      }
-      
-      // Put a limit on how far we go up
-      // At some point it stops mattering, plus this helps avoid inf loops
-      // caused by cycles getting into the tree structure
-      limit--;
-      if (limit == 0) return;
-      //fprintf(stderr, "-> %zu\n", node);
-    }
-  }
+  vector<unique_ptr<Tree>> trees(partitionCount);
+  vector<vector<size_t>> leftoverNodes(partitionCount);
+  vector<size_t> partitionThreadCounts(partitionCount);
+  vector<double> partitionTimes(partitionCount, 0);
+  vector<size_t> clusters(sigCount);
+  double start = 0;
   
-  size_t getNewNodeIdx(vector<size_t> &insertionList)
-  {
-    if (insertionList.empty()) {
-      fprintf(stderr, "ERROR: ran out of insertion points\n");
-      exit(1);
-    }
-    size_t idx = insertionList.back();
-    insertionList.pop_back();
-    
-    // Initialise lock
-    omp_init_lock(&locks[idx]);
-    return idx;
-  }
+  // Exceptions can't leave the parallel region, so the first is kept and rethrown after
+  exception_ptr error;
+  auto recordError = [&]() {
+    #pragma omp critical
+    if (!error) error = current_exception();
+  };
   
-  template<class RNG>
-  void splitNode(RNG &&rng, size_t node, const uint64_t *sig, vector<size_t> &insertionList, size_t link)
+  #pragma omp parallel
   {
-    //fprintf(stderr, "Splitting node %zu\n", node);
-    // Add 'sig' to the current node, splitting it in the process
-    //fprintf(stderr, "Adding signature:\n");
-    //dbgPrintSignature(sig);
-    size_t nodeSigs = childCounts[node] + 1; // Plus 1 to include new param *sig
-    vector<uint64_t> sigs(nodeSigs);
-    memcpy(&sigs[childCounts[node]], sig, sizeof(uint64_t)); // Add to end using memcpy
-    
-    for (int i = 0; i < childCounts[node]; i++) {
-      uint64_t *currentSig = &sigs[i];
-      uint64_t *matrix = &matrices[node * matrixSize];
-      for (size_t j = 0; j < 64; j++) {
-        currentSig[j / 64] |= ((matrix[j * matrixHeight + i / 64] >> (i % 64)) & 1) << (j % 64);
+    // Threads are split into contiguous groups, one per partition. If the team
+    // came up smaller than the partition count (e.g. with OMP_DYNAMIC), each
+    // thread instead builds every threadCount'th partition on its own.
+    size_t threadCount = omp_get_num_threads();
+    size_t thread = omp_get_thread_num();
+    vector<size_t> ownPartitions;
+    size_t localThread = 0;
+    size_t partitionThreads = 1;
+    if (threadCount >= partitionCount) {
+      size_t partition = thread * partitionCount / threadCount;
+      size_t firstThread = (partition * threadCount + partitionCount - 1) / partitionCount;
+      partitionThreads = ((partition + 1) * threadCount + partitionCount - 1) / partitionCount - firstThread;
+      localThread = thread - firstThread;
+      ownPartitions.push_back(partition);
+    } else {
+      for (size_t partition = thread; partition < partitionCount; partition += threadCount) {
+        ownPartitions.push_back(partition);
       }
     }
     
-    /*
-    fprintf(stderr, "Signatures converted for clustering:\n");
-    for (size_t i = 0; i < nodeSigs; i++) {
-      uint64_t *currentSig = &sigs[i];
-      //uint64_t *currentSig = &sigs[i * signatureSize];
-      dbgPrintSignature(currentSig);
-    }
-    */
-    
-    vector<uint64_t> meanSigs = createRandomSigs(rng, sigs);
-    vector<size_t> clusters(nodeSigs);
-    vector<vector<size_t>> clusterLists;
-    for (int iteration = 0; iteration < 4; iteration++) {
-      //fprintf(stderr, "Iteration %d\n", iteration);
-      reclusterSignatures(clusters, meanSigs, sigs);
-      clusterLists = createClusterLists(clusters);
-      meanSigs = createClusterSigs(clusterLists, sigs);
-    }
-    
-    /*
-    // Display clusters (debugging purposes)
-    for (const auto &clusterList : clusterLists) {
-      fprintf(stderr, "Cluster:\n");
-      for (size_t seqIdx : clusterList) {
-        uint64_t *currentSig = &sigs[seqIdx * signatureSize];
-        dbgPrintSignature(currentSig);
-      }
+    // Pinning only pays off when the partitions are spread over several nodes.
+    // The thread's previous affinity is restored before it leaves the region.
+    bool pinned = partitionCount > 1 && nodeCpus.size() > 1 && ownPartitions.size() == 1;
+    vector<int> previousCpus;
+    if (pinned) {
+      previousCpus = pinThreadToCpus(nodeCpus[ownPartitions[0] % nodeCpus.size()]);
     }
-    */
-    
-    // Create the sibling node
-    size_t sibling = getNewNodeIdx(insertionList);
-    
-    size_t newlyAddedIdx = childCounts[node];
     
-    childCounts[sibling] = clusterLists[1].size();
-    isBranchNode[sibling] = isBranchNode[node];
-    {
-      size_t siblingIdx = 0;
-      for (size_t seqIdx : clusterLists[1]) {
-        if (seqIdx < newlyAddedIdx) {
-          childLinks[sibling * order + siblingIdx] = childLinks[node * order + seqIdx];
-        } else {
-          childLinks[sibling * order + siblingIdx] = link;
+    // The first thread of each partition allocates its tree, so the arrays are
+    // first touched (and so placed) on the local node, then seeds it
+    if (localThread == 0) {
+      for (size_t partition : ownPartitions) {
+        try {
+          trees[partition].reset(new Tree(ktree_order, capacities[partition]));
+          partitionThreadCounts[partition] = partitionThreads;
+          default_random_engine seedRng;
+          for (size_t sig : seedSample) {
+            if (partitionOf[sig] == partition) {
+              trees[partition]->insert(seedRng, &sigs[sig], trees[partition]->freeNodes);
+            }
+          }
+        } catch (...) {
+          recordError();
         }
-        // If this is a branch node, relink the child to the new parent
-        if (isBranchNode[sibling]) {
-          parentLinks[childLinks[sibling * order + siblingIdx]] = sibling;
-        }
-        addSigToMatrix(&matrices[sibling * matrixSize], siblingIdx, &sigs[seqIdx]);
-        siblingIdx++;
       }
     }
-    memcpy(&means[sibling], &meanSigs[1], sizeof(uint64_t));
     
-    // Fill the current node with the other cluster of signatures
-    {
-      fill(&matrices[node * matrixSize], &matrices[node * matrixSize] + matrixSize, 0ull);
-      size_t nodeIdx = 0;
-      for (size_t seqIdx : clusterLists[0]) {
-        if (seqIdx < newlyAddedIdx) {
-          childLinks[node * order + nodeIdx] = childLinks[node * order + seqIdx];
-        } else {
-          childLinks[node * order + nodeIdx] = link;
-        }
-        // If this is a branch node, relink the child to the new parent
-        if (isBranchNode[node]) {
-          parentLinks[childLinks[node * order + nodeIdx]] = node;
-        }
-        addSigToMatrix(&matrices[node * matrixSize], nodeIdx, &sigs[seqIdx]);
-        nodeIdx++;
-      }
-    }
-    childCounts[node] = clusterLists[0].size();
+    // Time the inserts only, as in the single tree build, once every partition is seeded
+    #pragma omp barrier
+    #pragma omp single
+    start = omp_get_wtime();
     
-    // Is this the root level?
-    if (node == root) {
-      //fprintf(stderr, "Node being split is root node\n");
-      
-      // Create a new root node
-      size_t newRoot;
-      newRoot = getNewNodeIdx(insertionList);
-      
-      // Link this node and the sibling to it
-      parentLinks[node] = newRoot;
-      parentLinks[sibling] = newRoot;
-
-      childCounts[newRoot] = 2;
-      isBranchNode[newRoot] = 1;
-      childLinks[newRoot * order + 0] = node;
-      childLinks[newRoot * order + 1] = node;
-      addSigToMatrix(&matrices[newRoot * matrixSize], 0, &meanSigs[0]);
-      addSigToMatrix(&matrices[newRoot * matrixSize], 1, &meanSigs[1]);
+    for (size_t partition : ownPartitions) {
+      Tree *tree = trees[partition].get();
+      if (!tree || tree->root == numeric_limits<size_t>::max()) continue;
+      size_t begin = partitionBegin(partition);
+      size_t count = partitionBegin(partition + 1) - begin;
       
-      root = newRoot;
-    } else {
-      
-      // First, update the reference to this node in the parent with the new mean
-      size_t parent = parentLinks[node];
-      
-      // Lock the parent
-      omp_set_lock(&locks[parent]);
+      // Taking every partitionThreads'th free node keeps each list lowest-last
+      vector<size_t> insertionList;
+      for (size_t i = localThread; i < tree->freeNodes.size(); i += partitionThreads) {
+        insertionList.push_back(tree->freeNodes[i]);
+      }
       
-      size_t idx = numeric_limits<size_t>::max();
-      for (size_t i = 0; i < childCounts[parent]; i++) {
-        if (childLinks[parent * order + i] == node) {
-          idx = i;
+      default_random_engine rng;
+      for (size_t m = begin + count * localThread / partitionThreads; m < begin + count * (localThread + 1) / partitionThreads; m++) {
+        size_t sig = partitions.members[m];
+        if (seeded[sig]) continue;
+        try {
+          tree->insert(rng, &sigs[sig], insertionList);
+        } catch (...) {
+          recordError();
           break;
         }
       }
-      if (idx == numeric_limits<size_t>::max()) {
-        //fprintf(stderr, "Error: node %zu is not its parent's (%zu) child\n", node, parent);
-        
-        // Abort. Unlock the parent and get out of here
-        omp_unset_lock(&locks[parent]);
-        return;
-        
-        //exit(1);
-      }
-      
-      removeSigFromMatrix(&matrices[parent * matrixSize], idx);
-      addSigToMatrix(&matrices[parent * matrixSize], idx, &meanSigs[0]);
-      
-      // Connect sibling node to parent
-      parentLinks[sibling] = parent;
+      double elapsed = omp_get_wtime() - start;
       
-      // Now add a link in the parent node to the sibling node
-      if (childCounts[parent] + 1 < order) {
-        addSigToMatrix(&matrices[parent * matrixSize], childCounts[parent], &meanSigs[1]);
-        childLinks[parent * order + childCounts[parent]] = sibling;
-        childCounts[parent]++;
-        
-        // Update signatures (may change?)
-        recalculateUp(parent);
-      } else {
-        splitNode(rng, parent, &meanSigs[1], insertionList, sibling);
+      // Unused nodes go back to the tree, so it knows which ones were allocated
+      #pragma omp critical
+      {
+        leftoverNodes[partition].insert(leftoverNodes[partition].end(), insertionList.begin(), insertionList.end());
+        partitionTimes[partition] = max(partitionTimes[partition], elapsed);
       }
-      // Unlock the parent
-      omp_unset_lock(&locks[parent]);
     }
     
-    //fprintf(stderr, "Split finished\n");
-  }
-  
-  template<class RNG>
-  void insert(RNG &&rng, const uint64_t *signature, vector<size_t> &insertionList)
-  {
-    // Warning: ALWAYS INSERT THE FIRST NODE SINGLE-THREADED
-    // We don't have any protection from this because it would slow everything down to do so
-    if (root == numeric_limits<size_t>::max()) {
-      root = getNewNodeIdx(insertionList);
-      childCounts[root] = 0;
-      isBranchNode[root] = 0;
+    #pragma omp barrier
+    if (localThread == 0) {
+      for (size_t partition : ownPartitions) {
+        Tree *tree = trees[partition].get();
+        if (!tree || tree->root == numeric_limits<size_t>::max()) continue;
+        tree->freeNodes.swap(leftoverNodes[partition]);
+        sort(tree->freeNodes.begin(), tree->freeNodes.end(), greater<size_t>());
+        if (ktree_compact) {
+          tree->compact();
+        }
+      }
     }
+    #pragma omp barrier
     
-    size_t insertionPoint = traverse(signature);
-    
-    //fprintf(stderr, "Inserting at %zu\n", insertionPoint);
-    omp_set_lock(&locks[insertionPoint]);
-    if (childCounts[insertionPoint] < order) {
-      addSigToMatrix(&matrices[insertionPoint * matrixSize], childCounts[insertionPoint], signature);
-      childCounts[insertionPoint]++;
-    } else {
-      splitNode(rng, insertionPoint, signature, insertionList, 0);
+    // Leaves from different partitions are kept apart by offsetting them by
+    // the capacities of the partitions before
+    for (size_t partition : ownPartitions) {
+      Tree *tree = trees[partition].get();
+      if (!tree || tree->root == numeric_limits<size_t>::max()) continue;
+      size_t base = 0;
+      for (size_t p = 0; p < partition; p++) {
+        if (trees[p]) base += trees[p]->capacity;
+      }
+      size_t begin = partitionBegin(partition);
+      size_t count = partitionBegin(partition + 1) - begin;
+      for (size_t m = begin + count * localThread / partitionThreads; m < begin + count * (localThread + 1) / partitionThreads; m++) {
+        size_t sig = partitions.members[m];
+        clusters[sig] = base + tree->traverse(&sigs[sig]);
+      }
     }
-    omp_unset_lock(&locks[insertionPoint]);
     
-    //fprintf(stderr, "Node %zu now has %zu leaves\n", insertionPoint, childCounts[insertionPoint]);
-  }
-  
-  void destroyLocks(size_t node)
-  {
-    omp_destroy_lock(&locks[node]);
-    if (isBranchNode[node]) {
-      for (size_t i = 0; i < childCounts[node]; i++) {
-        destroyLocks(childLinks[node * order + i]);
-      }
+    if (pinned) {
+      pinThreadToCpus(previousCpus);
     }
   }
-  void destroyLocks()
-  {
-    destroyLocks(root);
+  if (error) rethrow_exception(error);
+  
+  // Seed signatures were inserted before the timer started, so aren't counted
+  double buildTime = *max_element(partitionTimes.begin(), partitionTimes.end());
+  for (size_t partition = 0; partition < partitionCount; partition++) {
+    size_t inserted = partitionBegin(partition + 1) - partitionBegin(partition) - seededCounts[partition];
+    fprintf(stderr, "Partition %zu: %zu signatures, %zu threads, %.0f inserts/s\n", partition, inserted, partitionThreadCounts[partition], inserted / max(partitionTimes[partition], 1e-9));
   }
-};
+  fprintf(stderr, "Overall throughput: %.0f inserts/s over %zu partitions\n", (sigCount - seedSample.size()) / max(buildTime, 1e-9), partitionCount);
+  
+  size_t clusterCount = compressClusterList(clusters);
+  fprintf(stderr, "Output %zu clusters\n", clusterCount);
+  
+  return clusters;
+}
 
-void compressClusterList(vector<size_t> &clusters)
+template<size_t Order>
+vector<size_t> clusterSignatures(const vector<uint64_t> &sigs)
 {
-  unordered_map<size_t, size_t> remap;
-  for (size_t &clus : clusters) {
-    if (remap.count(clus)) {
-      clus = remap[clus];
-    } else {
-      size_t newClus = remap.size();
-      remap[clus] = newClus;
-      clus = newClus;
-    }
+  if (ktree_numa) {
+    return clusterSignaturesNuma<Order>(sigs);
+  }
+  
+  size_t sigCount = sigs.size();
+  KTree<uint64_t, Order> tree(ktree_order, ktree_capacity);
+  
+  // Warm start: build a skeleton from a random sample single-threaded, so the
+  // parallel inserts spread across many leaves instead of fighting over the root.
+  // A sample size of 0 falls back to seeding with just the first signature.
+  default_random_engine rng;
+  vector<size_t> seedSample;
+  if (ktree_seed_sample == 0) {
+    seedSample.push_back(0);
+  } else {
+    seedSample = sampleSignatures(rng, sigCount, min(ktree_seed_sample, sigCount));
+  }
+  vector<char> seeded(sigCount, 0);
+  
+  double seedStart = omp_get_wtime();
+  for (size_t sig : seedSample) {
+    tree.insert(rng, &sigs[sig], tree.freeNodes);
+    seeded[sig] = 1;
+  }
+  double seedTime = omp_get_wtime() - seedStart;
+  
+  size_t seedNodes = tree.capacity - tree.freeNodes.size();
+  fprintf(stderr, "Seeded tree with %zu signatures (%zu nodes) in %.3fs\n", seedSample.size(), seedNodes, seedTime);
+  
+  // Track how quickly the first inserts after seeding go through, since that's
+  // where contention on the top of the tree is worst
+  BatchStats stats;
+  if (ktree_deterministic) {
+    stats = tree.insertBatchDeterministic(sigs.data(), sigCount, seeded.data());
+  } else {
+    stats = tree.insertBatch(sigs.data(), sigCount, seeded.data());
+  }
+  if (stats.inserted > 0) {
+    fprintf(stderr, "Early throughput: %.0f inserts/s over first %zu inserts\n", stats.earlyCount / max(stats.earlyTime, 1e-9), stats.earlyCount);
+    fprintf(stderr, "Overall throughput: %.0f inserts/s over %zu inserts\n", stats.inserted / max(stats.totalTime, 1e-9), stats.inserted);
+  }
+  
+  // Optionally pack the tree so reassignment streams through memory
+  if (ktree_compact) {
+    size_t oldCapacity = tree.capacity;
+    double compactStart = omp_get_wtime();
+    tree.compact();
+    fprintf(stderr, "Compacted tree from %zu to %zu nodes in %.3fs\n", oldCapacity, tree.capacity, omp_get_wtime() - compactStart);
   }
-  fprintf(stderr, "Output %zu clusters\n", remap.size());
+  
+  // We've created the tree. Now reinsert everything
+  vector<size_t> clusters = tree.classify(sigs.data(), sigCount);
+  
+  // We want to compress the cluster list down
+  size_t clusterCount = compressClusterList(clusters);
+  fprintf(stderr, "Output %zu clusters\n", clusterCount);
+  
+  return clusters;
 }
 
+// Common orders get a tree specialised at compile time, anything else falls back
+// to the runtime order
 vector<size_t> clusterSignatures(const vector<uint64_t> &sigs)
 {
-  size_t sigCount = sigs.size();
-  vector<size_t> clusters(sigCount);
-  KTree tree(ktree_order, ktree_capacity);
+  switch (ktree_order) {
+    case 4: return clusterSignatures<4>(sigs);
+    case 8: return clusterSignatures<8>(sigs);
+    case 10: return clusterSignatures<10>(sigs);
+    case 16: return clusterSignatures<16>(sigs);
+    case 32: return clusterSignatures<32>(sigs);
+    case 64: return clusterSignatures<64>(sigs);
+    default: return clusterSignatures<0>(sigs);
+  }
+}
+
+// Result of building a tree of one order over the autotune sample
+struct TuneResult {
+  size_t order;
+  double insertsPerSec;
+  double leafOccupancy; // average fraction of each leaf's slots in use
+  double clusterSize; // average number of signatures per leaf
+  double leafDistance; // average distance between two signatures in the same leaf
+  size_t nodesAllocated; // nodes taken from the arena, including any orphaned by aborted splits
+};
+
+template<size_t Order>
+TuneResult measureOrder(size_t order, const vector<uint64_t> &sample)
+{
+  // Inserts need about two nodes each on average, but a split can run all the
+  // way up to the root and take depth + 2. insertBatch shares the arena out
+  // evenly between threads and refuses a split once a thread holds fewer than
+  // depth + 3 nodes, so every thread also gets room for a split at a generous
+  // depth estimate (as if each node only had two children)
+  size_t depth = 1;
+  for (size_t n = 1; n < sample.size(); n *= 2) depth++;
+  KTree<uint64_t, Order> tree(order, 2 * sample.size() + 1 + omp_get_max_threads() * (depth + 3));
+  BatchStats stats = tree.insertBatch(sample.data(), sample.size());
   
-  vector<size_t> insertionList(1,0);
-  default_random_engine rng;
-  tree.insert(rng, &sigs[0], insertionList);
+  TuneResult result;
+  result.order = order;
+  result.insertsPerSec = stats.inserted / max(stats.totalTime, 1e-9);
+  result.nodesAllocated = tree.capacity - tree.freeNodes.size();
   
-  size_t nextFree = 1;
+  // Compacting leaves only the reachable nodes, which makes the leaves easy to find
+  tree.compact();
+  size_t leaves = 0;
+  size_t leafSigs = 0;
+  for (size_t node = 0; node < tree.capacity; node++) {
+    if (!tree.isBranchNode[node]) {
+      leaves++;
+      leafSigs += tree.childCounts[node];
+    }
+  }
+  result.leafOccupancy = leaves ? static_cast<double>(leafSigs) / (leaves * order) : 0;
   
-  #pragma omp parallel
-  {
-    default_random_engine rng;
-    vector<size_t> insertionList;
-    
-    #pragma omp for
-    for (size_t i = nextFree; i < ktree_capacity; i++) {
-      insertionList.push_back(ktree_capacity - i - 1);
+  // Average distance between pairs of signatures sharing a leaf, as a measure
+  // of how tight the clusters this order produces are
+  double pairDist = 0;
+  size_t pairs = 0;
+  vector<uint64_t> leafSigList;
+  for (size_t node = 0; node < tree.capacity; node++) {
+    if (tree.isBranchNode[node]) continue;
+    size_t count = tree.childCounts[node];
+    leafSigList.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      tree.getSigFromMatrix(&tree.matrices[node * tree.matrixSize()], i, &leafSigList[i]);
     }
-    
-    #pragma omp for
-    for (size_t i = 1; i < sigCount; i++) {
-      tree.insert(rng, &sigs[i], insertionList);
+    for (size_t i = 0; i < count; i++) {
+      for (size_t j = i + 1; j < count; j++) {
+        pairDist += signatureDistance(leafSigList[i], leafSigList[j]);
+        pairs++;
+      }
     }
   }
+  result.leafDistance = pairs ? pairDist / pairs : 0;
+  result.clusterSize = leaves ? static_cast<double>(leafSigs) / leaves : 0;
   
-  // We've created the tree. Now reinsert everything
-  #pragma omp parallel for
-  for (size_t i = 0; i < sigCount; i++) {
-    size_t clus = tree.traverse(&sigs[i]);
-    clusters[i] = clus;
+  return result;
+}
+
+TuneResult measureOrder(size_t order, const vector<uint64_t> &sample)
+{
+  switch (order) {
+    case 4: return measureOrder<4>(order, sample);
+    case 8: return measureOrder<8>(order, sample);
+    case 10: return measureOrder<10>(order, sample);
+    case 16: return measureOrder<16>(order, sample);
+    case 32: return measureOrder<32>(order, sample);
+    case 64: return measureOrder<64>(order, sample);
+    default: return measureOrder<0>(order, sample);
   }
+}
+
+// Build trees over a sample of the input for each of the specialised orders, and
+// pick the one with the best throughput once scaled by how full its leaves are
+// (a fast order that leaves most of every matrix empty just wastes memory).
+// Larger orders give larger clusters, so only orders whose average cluster size
+// stays within the target are considered. Unless a target is given it is the
+// cluster size of the requested order, so tuning never coarsens the clustering.
+// Capacity is then sized from the node count projected to the full input.
+void autotune(const vector<uint64_t> &sigs)
+{
+  const size_t orders[] = { 4, 8, 10, 16, 32, 64 };
   
-  // We want to compress the cluster list down
-  compressClusterList(clusters);
+  default_random_engine rng;
+  size_t sampleSize = min(ktree_autotune_sample, sigs.size());
+  vector<uint64_t> sample;
+  for (size_t sig : sampleSignatures(rng, sigs.size(), sampleSize)) {
+    sample.push_back(sigs[sig]);
+  }
   
-  // Recursively destroy all locks
-  tree.destroyLocks();
+  fprintf(stderr, "Autotuning on %zu signatures\n", sampleSize);
+  fprintf(stderr, "  order  inserts/s  leaf occupancy  cluster size  leaf distance  nodes\n");
+  vector<TuneResult> results;
+  bool requestedMeasured = false;
+  for (size_t order : orders) {
+    results.push_back(measureOrder(order, sample));
+    requestedMeasured |= order == ktree_order;
+  }
+  if (!requestedMeasured) {
+    results.push_back(measureOrder(ktree_order, sample));
+    sort(results.begin(), results.end(), [](const TuneResult &a, const TuneResult &b) { return a.order < b.order; });
+  }
   
-  return clusters;
+  double targetSize = static_cast<double>(ktree_autotune_cluster_size);
+  for (const TuneResult &result : results) {
+    fprintf(stderr, "  %5zu  %9.0f  %14.2f  %12.1f  %13.2f  %5zu\n", result.order, result.insertsPerSec, result.leafOccupancy, result.clusterSize, result.leafDistance, result.nodesAllocated);
+    if (!ktree_autotune_cluster_size && result.order == ktree_order) {
+      targetSize = result.clusterSize;
+    }
+  }
+  
+  // If no order meets the target, fall back to the one with the smallest clusters
+  TuneResult best = results[0];
+  for (const TuneResult &result : results) {
+    if (result.clusterSize < best.clusterSize) best = result;
+  }
+  double bestScore = -1;
+  for (const TuneResult &result : results) {
+    if (result.clusterSize > targetSize) continue;
+    double score = result.insertsPerSec * result.leafOccupancy;
+    if (score > bestScore) {
+      bestScore = score;
+      best = result;
+    }
+  }
+  fprintf(stderr, "Target cluster size: %.1f\n", targetSize);
+  
+  // Leave headroom, as the sample is only an estimate and splits in the full
+  // build can be aborted under contention
+  double nodesPerSig = static_cast<double>(best.nodesAllocated) / max<size_t>(sampleSize, 1);
+  ktree_order = best.order;
+  ktree_capacity = static_cast<size_t>(nodesPerSig * sigs.size() * 1.5) + 2 * ktree_seed_sample + 1024;
+  fprintf(stderr, "Autotune chose: -o %zu -c %zu\n", ktree_order, ktree_capacity);
 }
 
 int main(int argc, char **argv)
@@ -759,7 +522,17 @@ int main(int argc, char **argv)
     fprintf(stderr, "  -d [signature density]\n");
     fprintf(stderr, "  -o [tree order]\n");
     fprintf(stderr, "  -c [starting capacity]\n");
+    fprintf(stderr, "  -s [seed sample size]\n");
+    fprintf(stderr, "  --compact\n");
+    fprintf(stderr, "  --deterministic\n");
+    fprintf(stderr, "  --numa\n");
+    fprintf(stderr, "  --numa-nodes [partition count]\n");
+    fprintf(stderr, "  --autotune\n");
+    fprintf(stderr, "  --autotune-sample [sample size]\n");
+    fprintf(stderr, "  --autotune-cluster-size [average cluster size]\n");
     fprintf(stderr, "  --fasta-output\n");
+    fprintf(stderr, "  --grouped-output [file]\n");
+    fprintf(stderr, "  --cluster-dir [directory]\n");
     return 1;
   }
   // signatureWidth = 256;
@@ -774,7 +547,20 @@ int main(int argc, char **argv)
     if (arg == "-d") density = atof(argv[++a]);
     else if (arg == "-o") ktree_order = atoi(argv[++a]);
     else if (arg == "-c") ktree_capacity = atoi(argv[++a]);
+    else if (arg == "-s") ktree_seed_sample = atoi(argv[++a]);
+    else if (arg == "--compact") ktree_compact = true;
+    else if (arg == "--deterministic") ktree_deterministic = true;
+    else if (arg == "--numa") ktree_numa = true;
+    else if (arg == "--numa-nodes") {
+      ktree_numa = true;
+      ktree_numa_nodes = atoi(argv[++a]);
+    }
+    else if (arg == "--autotune") ktree_autotune = true;
+    else if (arg == "--autotune-sample") ktree_autotune_sample = atoi(argv[++a]);
+    else if (arg == "--autotune-cluster-size") ktree_autotune_cluster_size = atoi(argv[++a]);
     else if (arg == "--fasta-output") fastaOutput = true;
+    else if (arg == "--grouped-output") groupedOutput = argv[++a];
+    else if (arg == "--cluster-dir") clusterDir = argv[++a];
     else if (fastaFile.empty()) fastaFile = arg;
     else {
       fprintf(stderr, "Invalid or extra argument: %s\n", arg.c_str());
@@ -782,24 +568,46 @@ int main(int argc, char **argv)
     }
   }
     
+  if (ktree_numa && ktree_deterministic) {
+    fprintf(stderr, "Error: --numa cannot be combined with --deterministic\n");
+    return 1;
+  }
+  
   if (density < 0.0f || density > 1.0f) {
     fprintf(stderr, "Error: density must be a positive value between 0 and 1\n");
     return 1;
   }
   
-  fprintf(stderr, "Loading fasta...");
-  auto fasta = loadFasta(fastaFile.c_str());
-  fprintf(stderr, " loaded %llu sequences\n", static_cast<unsigned long long>(fasta.size()));
-  fprintf(stderr, "Converting fasta to signatures...");
-  auto sigs = convertFastaToSignatures(fasta);
-  fprintf(stderr, " done\n");
-  fprintf(stderr, "Clustering signatures...\n");
-  auto clusters = clusterSignatures(sigs);
-  fprintf(stderr, "Writing output\n");
-  if (!fastaOutput) {
-    outputClusters(clusters);
-  } else {
-    outputFastaClusters(clusters, fasta);
+  try {
+    fprintf(stderr, "Loading fasta...");
+    auto fasta = loadFasta(fastaFile.c_str());
+    fprintf(stderr, " loaded %llu sequences\n", static_cast<unsigned long long>(fasta.size()));
+    fprintf(stderr, "Converting fasta to signatures...");
+    auto sigs = convertFastaToSignatures(fasta);
+    fprintf(stderr, " done\n");
+    if (ktree_autotune) {
+      autotune(sigs);
+    }
+    fprintf(stderr, "Clustering signatures...\n");
+    auto clusters = clusterSignatures(sigs);
+    fprintf(stderr, "Writing output\n");
+    if (!groupedOutput.empty() || !clusterDir.empty()) {
+      auto groups = groupByCluster(clusters);
+      auto medoids = findClusterMedoids(groups, sigs);
+      if (!groupedOutput.empty()) {
+        outputGroupedFasta(groupedOutput.c_str(), groups, medoids, fasta);
+      }
+      if (!clusterDir.empty()) {
+        outputClusterFiles(clusterDir.c_str(), groups, medoids, fasta);
+      }
+    } else if (!fastaOutput) {
+      outputClusters(clusters);
+    } else {
+      outputFastaClusters(clusters, fasta);
+    }
+  } catch (const exception &e) {
+    fprintf(stderr, "\nError: %s\n", e.what());
+    return 1;
   }
   
   return 0;
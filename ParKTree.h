@@ -0,0 +1,98 @@
+#ifndef PARKTREE_PARKTREE_H
+#define PARKTREE_PARKTREE_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "KTree.h"
+
+namespace parktree {
+
+// Functions here throw std::runtime_error on I/O failures
+
+std::vector<std::pair<std::string, std::string>> loadFasta(const char *path);
+
+// Binary encode a sequence, two bits per nucleotide
+void generateSignature(uint64_t *output, const std::pair<std::string, std::string> &fasta);
+std::vector<uint64_t> convertFastaToSignatures(const std::vector<std::pair<std::string, std::string>> &fasta);
+
+void outputClusters(const std::vector<size_t> &clusters);
+void outputFastaClusters(const std::vector<size_t> &clusters, const std::vector<std::pair<std::string, std::string>> &fasta);
+
+// Records grouped by cluster: the members of cluster c are
+// members[offsets[c]] .. members[offsets[c + 1] - 1], in input order
+struct ClusterGroups {
+  std::vector<size_t> offsets; // clusterCount + 1 entries
+  std::vector<size_t> members; // one entry per record
+  
+  size_t clusterCount() const { return offsets.size() - 1; }
+  size_t clusterSize(size_t cluster) const { return offsets[cluster + 1] - offsets[cluster]; }
+};
+
+// Parallel counting sort of the records by their (compressed) cluster ID
+ClusterGroups groupByCluster(const std::vector<size_t> &clusters);
+
+// Write the records grouped by cluster to a single fasta file, plus an index at
+// path + ".idx" giving each cluster's byte offset, length, size and medoid read
+void outputGroupedFasta(const char *path, const ClusterGroups &groups, const std::vector<size_t> &medoids, const std::vector<std::pair<std::string, std::string>> &fasta);
+
+// Write each cluster to its own fasta file in dir, plus an index.tsv giving each
+// cluster's size and medoid read
+void outputClusterFiles(const char *dir, const ClusterGroups &groups, const std::vector<size_t> &medoids, const std::vector<std::pair<std::string, std::string>> &fasta);
+
+// Find the medoid record of each cluster, i.e. the member with the smallest total
+// distance to the rest. Distance counts mismatching nucleotides, so the total can
+// be taken from per-position base counts rather than comparing every pair.
+template<class Signature>
+std::vector<size_t> findClusterMedoids(const ClusterGroups &groups, const std::vector<Signature> &sigs)
+{
+  typedef SignatureTraits<Signature> Traits;
+  constexpr size_t positions = Traits::words * 32;
+  std::vector<size_t> medoids(groups.clusterCount());
+  
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t cluster = 0; cluster < groups.clusterCount(); cluster++) {
+    const size_t *first = &groups.members[groups.offsets[cluster]];
+    size_t size = groups.clusterSize(cluster);
+    
+    std::vector<std::array<size_t, 4>> baseCounts(positions);
+    for (size_t m = 0; m < size; m++) {
+      const uint64_t *words = Traits::data(sigs[first[m]]);
+      for (size_t pos = 0; pos < positions; pos++) {
+        baseCounts[pos][(words[pos / 32] >> ((pos % 32) * 2)) & 0x3]++;
+      }
+    }
+    
+    size_t minTotalDist = std::numeric_limits<size_t>::max();
+    for (size_t m = 0; m < size; m++) {
+      const uint64_t *words = Traits::data(sigs[first[m]]);
+      size_t totalDist = 0;
+      for (size_t pos = 0; pos < positions; pos++) {
+        totalDist += size - baseCounts[pos][(words[pos / 32] >> ((pos % 32) * 2)) & 0x3];
+      }
+      if (totalDist < minTotalDist) {
+        minTotalDist = totalDist;
+        medoids[cluster] = first[m];
+      }
+    }
+  }
+  return medoids;
+}
+
+// CPUs belonging to each NUMA node, read from sysfs. Falls back to a single node
+// holding every CPU this process may run on.
+std::vector<std::vector<int>> numaNodeCpus();
+
+// Restrict the calling thread to the given CPUs. Memory it first touches
+// afterwards is then allocated on their NUMA node. Returns the CPUs the thread
+// could run on before, so passing them back in undoes the pinning.
+std::vector<int> pinThreadToCpus(const std::vector<int> &cpus);
+
+// Convert binary signature back to genetic string
+void dbgPrintSignature(const uint64_t *sig);
+
+}
+
+#endif
@@ -0,0 +1,377 @@
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ParKTree.h"
+
+using namespace std;
+
+namespace parktree {
+
+/** Char to binary encoding */
+static const vector<uint8_t> nucleotideIndex{ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,3 };
+static const vector<char> signatureIndex{ 'A', 'C', 'G', 'T' };
+
+vector<pair<string, string>> loadFasta(const char *path)
+{
+  vector<pair<string, string>> sequences;
+
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    throw runtime_error("Failed to load " + string(path));
+  }
+  for (;;) {
+    char seqNameBuf[8192];
+    if (fscanf(fp, " >%[^\n]\n", seqNameBuf) < 1) break;
+    string sequenceBuf;
+
+    for (;;) {
+      int c = fgetc(fp);
+      if (c == EOF || c == '>') {
+        ungetc(c, fp);
+        break;
+      }
+      if (isalpha(c)) {
+        sequenceBuf.push_back(c);
+      }
+    }
+    sequences.push_back(make_pair(string(seqNameBuf), sequenceBuf));
+  }
+  fclose(fp);
+
+  return sequences;
+}
+
+void generateSignature(uint64_t *output, const pair<string, string> &fasta)
+{
+  // Binary encode genetic string
+  string fastaSequence = fasta.second;
+  uint64_t sig = 0;
+  for (size_t j = 0; j < fastaSequence.length(); j++) {
+    char c = fastaSequence[j];
+    sig |= (uint64_t)(nucleotideIndex[c]) << (j * 2);
+  }
+  *output = sig;
+}
+
+vector<uint64_t> convertFastaToSignatures(const vector<pair<string, string>> &fasta)
+{
+  vector<uint64_t> output;
+  // Allocate space for the strings
+  output.resize(fasta.size());
+  // output.resize(fasta.size() * signatureSize);
+  
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < fasta.size(); i++) {
+    generateSignature(&output[i], fasta[i]);
+    // generateSignature(&output[signatureSize * i], fasta[i]);
+  }
+  
+  return output;
+}
+
+void outputClusters(const vector<size_t> &clusters)
+{
+  for (size_t sig = 0; sig < clusters.size(); sig++)
+  {
+    printf("%llu,%llu\n", static_cast<unsigned long long>(sig), static_cast<unsigned long long>(clusters[sig]));
+  }
+}
+
+void outputFastaClusters(const vector<size_t> &clusters, const vector<pair<string, string>> &fasta)
+{
+  fprintf(stderr, "Writing out %zu records\n", clusters.size());
+  for (size_t sig = 0; sig < clusters.size(); sig++)
+  {
+    printf(">%llu\n%s\n", static_cast<unsigned long long>(clusters[sig]), fasta[sig].second.c_str());
+  }
+}
+
+// Grouped output is formatted per thread and flushed in chunks of this size
+static const size_t outputBufferSize = 1 << 22;
+
+// Grouped records keep their name after the cluster ID, so the ID stays the first word
+static size_t recordLength(size_t cluster, const pair<string, string> &record)
+{
+  return 1 + to_string(cluster).size() + 1 + record.first.size() + 1 + record.second.size() + 1;
+}
+
+static void appendRecord(string &buffer, size_t cluster, const pair<string, string> &record)
+{
+  buffer += '>';
+  buffer += to_string(cluster);
+  buffer += ' ';
+  buffer += record.first;
+  buffer += '\n';
+  buffer += record.second;
+  buffer += '\n';
+}
+
+static bool writeAt(int fd, const string &buffer, size_t offset)
+{
+  size_t written = 0;
+  while (written < buffer.size()) {
+    ssize_t n = pwrite(fd, buffer.data() + written, buffer.size() - written, offset + written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Format clusters first..last-1 and write them to fd starting at offset, flushing
+// the buffer whenever it fills. Returns false if a write fails.
+static bool writeClusters(int fd, size_t offset, size_t first, size_t last, const ClusterGroups &groups, const vector<pair<string, string>> &fasta, string &buffer)
+{
+  for (size_t cluster = first; cluster < last; cluster++) {
+    for (size_t m = groups.offsets[cluster]; m < groups.offsets[cluster + 1]; m++) {
+      appendRecord(buffer, cluster, fasta[groups.members[m]]);
+      if (buffer.size() >= outputBufferSize) {
+        if (!writeAt(fd, buffer, offset)) {
+          buffer.clear();
+          return false;
+        }
+        offset += buffer.size();
+        buffer.clear();
+      }
+    }
+  }
+  bool ok = writeAt(fd, buffer, offset);
+  buffer.clear();
+  return ok;
+}
+
+ClusterGroups groupByCluster(const vector<size_t> &clusters)
+{
+  ClusterGroups groups;
+  size_t count = clusters.size();
+  size_t clusterCount = 0;
+  
+  #pragma omp parallel for reduction(max:clusterCount)
+  for (size_t i = 0; i < count; i++) {
+    clusterCount = max(clusterCount, clusters[i] + 1);
+  }
+  groups.offsets.assign(clusterCount + 1, 0);
+  groups.members.resize(count);
+  
+  // One shared count per cluster, so memory doesn't grow with the thread count
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; i++) {
+    #pragma omp atomic
+    groups.offsets[clusters[i] + 1]++;
+  }
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    groups.offsets[cluster + 1] += groups.offsets[cluster];
+  }
+  
+  vector<size_t> next(groups.offsets.begin(), groups.offsets.end() - 1);
+  #pragma omp parallel for
+  for (size_t i = 0; i < count; i++) {
+    size_t pos;
+    #pragma omp atomic capture
+    pos = next[clusters[i]]++;
+    groups.members[pos] = i;
+  }
+  
+  // Threads claim slots in whatever order they get to them, so put every
+  // cluster's members back in input order
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    sort(groups.members.begin() + groups.offsets[cluster], groups.members.begin() + groups.offsets[cluster + 1]);
+  }
+  
+  return groups;
+}
+
+void outputGroupedFasta(const char *path, const ClusterGroups &groups, const vector<size_t> &medoids, const vector<pair<string, string>> &fasta)
+{
+  size_t clusterCount = groups.clusterCount();
+  fprintf(stderr, "Writing out %zu records in %zu clusters to %s\n", groups.members.size(), clusterCount, path);
+  
+  // Work out where every cluster starts in the file up front, so blocks of
+  // clusters can be formatted and written independently
+  vector<size_t> byteOffsets(clusterCount + 1, 0);
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    size_t length = 0;
+    for (size_t m = groups.offsets[cluster]; m < groups.offsets[cluster + 1]; m++) {
+      length += recordLength(cluster, fasta[groups.members[m]]);
+    }
+    byteOffsets[cluster + 1] = length;
+  }
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    byteOffsets[cluster + 1] += byteOffsets[cluster];
+  }
+  
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw runtime_error("Failed to open " + string(path));
+  }
+  
+  // Adjacent clusters are adjacent in the file, so each block of clusters is
+  // written with as few large writes as possible
+  const size_t blockSize = 256;
+  bool failed = false;
+  #pragma omp parallel
+  {
+    string buffer;
+    buffer.reserve(outputBufferSize);
+    
+    #pragma omp for schedule(dynamic)
+    for (size_t block = 0; block < clusterCount; block += blockSize) {
+      size_t blockEnd = min(block + blockSize, clusterCount);
+      if (!writeClusters(fd, byteOffsets[block], block, blockEnd, groups, fasta, buffer)) {
+        #pragma omp atomic write
+        failed = true;
+      }
+    }
+  }
+  close(fd);
+  if (failed) {
+    throw runtime_error("Failed to write " + string(path));
+  }
+  
+  string indexPath = string(path) + ".idx";
+  FILE *fp = fopen(indexPath.c_str(), "w");
+  if (!fp) {
+    throw runtime_error("Failed to open " + indexPath);
+  }
+  setvbuf(fp, nullptr, _IOFBF, outputBufferSize);
+  fprintf(fp, "#cluster\toffset\tlength\tsize\tmedoid\n");
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    fprintf(fp, "%zu\t%zu\t%zu\t%zu\t%s\n", cluster, byteOffsets[cluster], byteOffsets[cluster + 1] - byteOffsets[cluster], groups.clusterSize(cluster), fasta[medoids[cluster]].first.c_str());
+  }
+  fclose(fp);
+}
+
+void outputClusterFiles(const char *dir, const ClusterGroups &groups, const vector<size_t> &medoids, const vector<pair<string, string>> &fasta)
+{
+  size_t clusterCount = groups.clusterCount();
+  fprintf(stderr, "Writing out %zu records in %zu clusters to %s\n", groups.members.size(), clusterCount, dir);
+  
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    throw runtime_error("Failed to create directory " + string(dir));
+  }
+  
+  string failedPath;
+  #pragma omp parallel
+  {
+    string buffer;
+    buffer.reserve(outputBufferSize);
+    
+    #pragma omp for schedule(dynamic)
+    for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+      string clusterPath = string(dir) + "/" + to_string(cluster) + ".fasta";
+      int fd = open(clusterPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || !writeClusters(fd, 0, cluster, cluster + 1, groups, fasta, buffer)) {
+        buffer.clear();
+        #pragma omp critical
+        if (failedPath.empty()) failedPath = clusterPath;
+      }
+      if (fd >= 0) close(fd);
+    }
+  }
+  if (!failedPath.empty()) {
+    throw runtime_error("Failed to write " + failedPath);
+  }
+  
+  string indexPath = string(dir) + "/index.tsv";
+  FILE *fp = fopen(indexPath.c_str(), "w");
+  if (!fp) {
+    throw runtime_error("Failed to open " + indexPath);
+  }
+  setvbuf(fp, nullptr, _IOFBF, outputBufferSize);
+  fprintf(fp, "#cluster\tsize\tmedoid\tfile\n");
+  for (size_t cluster = 0; cluster < clusterCount; cluster++) {
+    fprintf(fp, "%zu\t%zu\t%s\t%zu.fasta\n", cluster, groups.clusterSize(cluster), fasta[medoids[cluster]].first.c_str(), cluster);
+  }
+  fclose(fp);
+}
+
+// Parse a sysfs list such as "0-15,32-47". Returns an empty list if the file is missing
+static vector<int> parseCpuList(const string &path)
+{
+  vector<int> cpus;
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) return cpus;
+  int first, last;
+  while (fscanf(fp, "%d", &first) == 1) {
+    last = first;
+    int c = fgetc(fp);
+    if (c == '-') {
+      if (fscanf(fp, "%d", &last) != 1) break;
+      c = fgetc(fp);
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    if (c != ',') break;
+  }
+  fclose(fp);
+  return cpus;
+}
+
+vector<vector<int>> numaNodeCpus()
+{
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  
+  vector<vector<int>> nodes;
+  for (int node : parseCpuList("/sys/devices/system/node/online")) {
+    vector<int> cpus;
+    for (int cpu : parseCpuList("/sys/devices/system/node/node" + to_string(node) + "/cpulist")) {
+      if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (!cpus.empty()) nodes.push_back(cpus);
+  }
+  
+  if (nodes.empty()) {
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    nodes.push_back(cpus);
+  }
+  return nodes;
+}
+
+vector<int> pinThreadToCpus(const vector<int> &cpus)
+{
+  cpu_set_t previous;
+  CPU_ZERO(&previous);
+  sched_getaffinity(0, sizeof(previous), &previous);
+  vector<int> previousCpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &previous)) previousCpus.push_back(cpu);
+  }
+  
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    fprintf(stderr, "Warning: failed to set thread CPU affinity\n");
+  }
+  return previousCpus;
+}
+
+void dbgPrintSignature(const uint64_t *sig)
+{
+  fprintf(stderr, "%p: ", sig);
+  uint64_t signature  = *sig;
+  string sequence = string(20, ' ');
+  for (size_t j = 0; j < 20; j++) {
+    sequence[j] = signatureIndex[(signature >> (j * 2)) & 0x3];
+  }
+  fprintf(stderr, "%s", sequence.c_str());
+  fprintf(stderr, "\n");
+}
+
+}